@@ -0,0 +1,288 @@
+#pragma once
+#include "GenericPacket.h"
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <memory>
+
+/** \brief A chain of non-contiguous buffers (a rope) of received data
+ *
+ * Chunks are appended as they arrive and are never concatenated. Bytes are
+ * consumed from the front with remove(), which drops chunks, and with them
+ * their owners, once they are used up. ChunkedPacket decodes packets directly
+ * from a chain.
+ */
+class ChunkChain
+{
+private:
+	struct Chunk
+	{
+		const char *data;
+		std::size_t size;
+		/* Keeps data alive, and may release it in its deleter: */
+		std::shared_ptr<const void> owner;
+	};
+	using ChunkIterator = std::deque<Chunk>::const_iterator;
+
+public:
+	/** \brief A contiguous part of the chain */
+	struct Segment
+	{
+		const char *data;
+		std::size_t size;
+	};
+
+	/** \brief A range of bytes in the chain, presented as segments
+	 *
+	 * Only valid until the bytes are removed from the chain, or chunks are
+	 * appended to it.
+	 */
+	class Segments
+	{
+	public:
+		class const_iterator
+		{
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = Segment;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const Segment *;
+			using reference = Segment;
+
+			Segment operator*() const
+			{
+				return { m_chunk->data + m_offset, std::min(m_chunk->size - m_offset, m_remaining) };
+			}
+			const_iterator &operator++()
+			{
+				m_remaining -= (**this).size;
+				++m_chunk;
+				m_offset = 0;
+				return *this;
+			}
+			const_iterator operator++(int) { const_iterator old = *this; ++*this; return old; }
+			/* Iterators over the same range only differ in what remains: */
+			bool operator==(const const_iterator &other) const { return m_remaining == other.m_remaining; }
+			bool operator!=(const const_iterator &other) const { return !(*this == other); }
+
+		private:
+			friend class Segments;
+			const_iterator(ChunkIterator chunk, std::size_t offset, std::size_t remaining)
+				: m_chunk(chunk), m_offset(offset), m_remaining(remaining) {}
+
+			ChunkIterator m_chunk;
+			std::size_t m_offset;
+			std::size_t m_remaining;
+		};
+
+		Segments() = default;
+
+		const_iterator begin() const { return { m_chunk, m_offset, m_size }; }
+		const_iterator end() const { return { m_chunk, 0, 0 }; }
+		/** \brief Number of bytes in the range */
+		std::size_t size() const { return m_size; }
+		/** \brief Number of segments */
+		std::size_t count() const { return static_cast<std::size_t>(std::distance(begin(), end())); }
+		/** \brief Whether the bytes are contiguous, i.e. in at most one segment */
+		bool isContiguous() const { return m_size == 0 || m_chunk->size - m_offset >= m_size; }
+		/** \brief Copy the bytes to \p data, which must hold size() bytes */
+		void copyTo(char *data) const;
+		/** \brief The bytes as one QByteArray
+		 *
+		 * A contiguous range is shared (see QByteArray::fromRawData()), and
+		 * only valid as long as the range is. Otherwise the bytes are copied.
+		 */
+		QByteArray toByteArray() const;
+
+	private:
+		friend class ChunkChain;
+		Segments(ChunkIterator chunk, std::size_t offset, std::size_t size)
+			: m_chunk(chunk), m_offset(offset), m_size(size) {}
+
+		ChunkIterator m_chunk;
+		std::size_t m_offset = 0;
+		std::size_t m_size = 0;
+	};
+
+	/** \brief Append \p size bytes at \p data
+	 *
+	 * The memory must stay valid until it is removed from the chain. \p owner
+	 * is kept until then, and its deleter may be used to recycle the buffer.
+	 */
+	void append(const char *data, std::size_t size, std::shared_ptr<const void> owner = {});
+	/** \brief Append a QByteArray, sharing (not copying) its data */
+	void append(QByteArray data);
+
+	/** \brief Number of bytes in the chain */
+	std::size_t size() const { return m_size; }
+	bool isEmpty() const { return m_size == 0; }
+	/** \brief Number of chunks holding the bytes */
+	std::size_t chunkCount() const { return m_chunks.size(); }
+
+	/** \brief The \p size bytes at \p offset as segments
+	 *
+	 * Throws a std::out_of_range if the chain is too short.
+	 */
+	Segments segments(std::size_t offset, std::size_t size) const;
+	/** \brief Pointer to \p size contiguous bytes at \p offset
+	 *
+	 * The bytes are returned in place if they are in one chunk, and are
+	 * otherwise copied to \p scratch, which must hold \p size bytes. Throws a
+	 * std::out_of_range if the chain is too short.
+	 */
+	const char *peek(std::size_t offset, std::size_t size, char *scratch) const;
+
+	/** \brief Remove \p size bytes from the front, dropping used up chunks */
+	void remove(std::size_t size);
+	void clear();
+
+private:
+	std::deque<Chunk> m_chunks;
+	/* Bytes of the first chunk that are already removed: */
+	std::size_t m_offset = 0;
+	std::size_t m_size = 0;
+};
+
+/** \brief A packet decoded from a ChunkChain without copying its payload
+ *
+ * The header is parsed even if it straddles chunks, and the payload is
+ * presented as the segments it occupies. Only valid until the packet's bytes
+ * are removed from the chain (see dataSize()).
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+struct ChunkedPacket
+{
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	using Result = typename Packet::template Result<ChunkedPacket>;
+
+	Header header;
+	ChunkChain::Segments payloadSegments;
+
+	/** \brief Parse the packet at the front of \p chain
+	 *
+	 * Like GenericPacket::tryDecodeView(), but for chained buffers.
+	 */
+	static Result tryDecode(const ChunkChain &chain, std::size_t maxPayloadSize = Header::maxSize());
+
+	std::size_t payloadSize() const { return header.size(); }
+	/** \brief Number of bytes to remove from the chain to consume the packet */
+	std::size_t dataSize() const { return Header::dataSize() + payloadSize(); }
+	/** \brief See ChunkChain::Segments::toByteArray() */
+	QByteArray payload() const { return payloadSegments.toByteArray(); }
+	/** \brief Deep-copy the packet */
+	Packet toPacket() const;
+};
+
+
+inline void ChunkChain::Segments::copyTo(char *data) const
+{
+	for (const Segment segment : *this)
+	{
+		std::memcpy(data, segment.data, segment.size);
+		data += segment.size;
+	}
+}
+
+inline QByteArray ChunkChain::Segments::toByteArray() const
+{
+	if (isContiguous())
+		return m_size ? QByteArray::fromRawData((*begin()).data, static_cast<GenericPacketHelper::ByteArraySize>(m_size))
+			: QByteArray();
+
+	QByteArray data;
+	data.resize(static_cast<GenericPacketHelper::ByteArraySize>(m_size));
+	copyTo(data.data());
+	return data;
+}
+
+inline void ChunkChain::append(const char *data, std::size_t size, std::shared_ptr<const void> owner)
+{
+	if (!size)
+		return;
+
+	m_chunks.push_back(Chunk{data, size, std::move(owner)});
+	m_size += size;
+}
+
+inline void ChunkChain::append(QByteArray data)
+{
+	const auto owner = std::make_shared<const QByteArray>(std::move(data));
+	append(owner->constData(), static_cast<std::size_t>(owner->size()), owner);
+}
+
+inline ChunkChain::Segments ChunkChain::segments(std::size_t offset, std::size_t size) const
+{
+	if (offset > m_size || size > m_size - offset)
+		GENERICPACKET_THROW(std::out_of_range("Range exceeds chunk chain"));
+
+	auto chunk = m_chunks.cbegin();
+	offset += m_offset;
+	/* Skip whole chunks, but never past the end for an empty range: */
+	while (chunk != m_chunks.cend() && offset >= chunk->size && (size || offset > chunk->size))
+	{
+		offset -= chunk->size;
+		++chunk;
+	}
+	return Segments(chunk, offset, size);
+}
+
+inline const char *ChunkChain::peek(std::size_t offset, std::size_t size, char *scratch) const
+{
+	const Segments range = segments(offset, size);
+	if (range.isContiguous())
+		return size ? (*range.begin()).data : scratch;
+
+	range.copyTo(scratch);
+	return scratch;
+}
+
+inline void ChunkChain::remove(std::size_t size)
+{
+	size = std::min(size, m_size);
+	m_size -= size;
+	size += m_offset;
+	while (!m_chunks.empty() && size >= m_chunks.front().size)
+	{
+		size -= m_chunks.front().size;
+		m_chunks.pop_front();
+	}
+	m_offset = size;
+}
+
+inline void ChunkChain::clear()
+{
+	m_chunks.clear();
+	m_offset = 0;
+	m_size = 0;
+}
+
+template<typename S, typename T>
+typename ChunkedPacket<S, T>::Result ChunkedPacket<S, T>::tryDecode(const ChunkChain &chain, std::size_t maxPayloadSize)
+{
+	if (chain.size() < Header::dataSize())
+		return DecodeStatus::Incomplete;
+
+	/* A header split across chunks is assembled here: */
+	char scratch[sizeof(GenericPacketHelper::RawHeader<S, T>)];
+	const auto header = Header::tryDecode(chain.peek(0, Header::dataSize(), scratch), Header::dataSize());
+	if (!header)
+		return header.status();
+	if (header->size() > maxPayloadSize)
+		return DecodeStatus::Oversized;
+	if (chain.size() - Header::dataSize() < header->size())
+		return DecodeStatus::Incomplete;
+
+	return ChunkedPacket{*header, chain.segments(Header::dataSize(), header->size())};
+}
+
+template<typename S, typename T>
+typename ChunkedPacket<S, T>::Packet ChunkedPacket<S, T>::toPacket() const
+{
+	QByteArray data;
+	data.resize(static_cast<GenericPacketHelper::ByteArraySize>(payloadSize()));
+	payloadSegments.copyTo(data.data());
+	return Packet{Type{header.type()}, std::move(data)};
+}
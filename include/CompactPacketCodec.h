@@ -0,0 +1,184 @@
+#pragma once
+#include "GenericPacket.h"
+#include <type_traits>
+#include <unordered_map>
+
+/** \brief Encodes packets without a size field for types of a fixed payload size
+ *
+ * Types are registered with the payload size all their packets have. Frames
+ * start with the type, followed by the size only for types that are not
+ * registered, then the payload, all in network byte order. For a registered
+ * type, the size field is left out and inferred from the type when decoding.
+ * E.g. with 32-bit sizes and types, a 12-byte payload takes 16 bytes instead
+ * of 20.
+ *
+ * This is a different wire format from GenericPacket::toData(), so both peers
+ * have to use the codec, with the same registrations. Decoded packets are
+ * plain GenericPacket and GenericPacket::View.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class CompactPacketCodec
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Size = typename Packet::Size;
+	using Type = typename Packet::Type;
+	using View = typename Packet::View;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	using ConstData = GenericPacketHelper::ConstData;
+
+	/** \brief Elide the size of \p type, whose payloads are all \p payloadSize bytes */
+	CompactPacketCodec &setFixedSize(Type type, std::size_t payloadSize);
+	/** \brief Elide the size of \p type, whose payloads are a \p Payload each */
+	template<typename Payload>
+	CompactPacketCodec &setFixedSize(Type type)
+	{
+		static_assert(std::is_trivially_copyable<Payload>::value, "Fixed-size payloads must be trivially copyable");
+		return setFixedSize(type, sizeof(Payload));
+	}
+	CompactPacketCodec &removeFixedSize(Type type)
+	{
+		m_fixedSizes.erase(type.value);
+		return *this;
+	}
+
+	bool hasFixedSize(Type type) const { return m_fixedSizes.count(type.value) != 0; }
+	/** \brief Size of the header of frames of \p type */
+	std::size_t headerSize(Type type) const { return sizeof(T) + (hasFixedSize(type) ? 0 : sizeof(S)); }
+	std::size_t dataSize(const Packet &packet) const;
+
+	/** \brief Encode \p packet
+	 *
+	 * Throws a std::length_error if its type has a fixed size its payload
+	 * does not match.
+	 */
+	QByteArray toData(const Packet &packet) const;
+	/** \brief Append the encoded \p packet to \p data. Throws like toData() */
+	void appendTo(QByteArray &data, const Packet &packet) const;
+
+	/** \brief Parse a frame without copying its payload
+	 *
+	 * Returns the same statuses as GenericPacket::tryDecodeView(). The view's
+	 * payload points into \p data, and the frame is headerSize() +
+	 * payloadSize() bytes long.
+	 */
+	typename Packet::template Result<View> tryDecodeView(const char *data, std::size_t size,
+			std::size_t maxPayloadSize = Header::maxSize()) const;
+	typename Packet::template Result<View> tryDecodeView(ConstData data,
+			std::size_t maxPayloadSize = Header::maxSize()) const;
+	/** \brief Like tryDecodeView(), but copy the packet and remove its bytes from \p data */
+	typename Packet::template Result<Packet> tryExtract(QByteArray &data,
+			std::size_t maxPayloadSize = Header::maxSize()) const;
+
+private:
+	void ensureFixedSizeMatches(const Packet &packet) const;
+
+	std::unordered_map<T, S> m_fixedSizes;
+};
+
+
+template<typename S, typename T>
+CompactPacketCodec<S, T> &CompactPacketCodec<S, T>::setFixedSize(Type type, std::size_t payloadSize)
+{
+	GenericPacketHelper::ensureSizeCanHoldPayload(Header::maxSize(), payloadSize);
+	m_fixedSizes[type.value] = static_cast<S>(payloadSize);
+	return *this;
+}
+
+template<typename S, typename T>
+std::size_t CompactPacketCodec<S, T>::dataSize(const Packet &packet) const
+{
+	return headerSize(Type{packet.header().type()}) + static_cast<std::size_t>(packet.payload().size());
+}
+
+template<typename S, typename T>
+QByteArray CompactPacketCodec<S, T>::toData(const Packet &packet) const
+{
+	QByteArray data;
+	data.reserve(static_cast<GenericPacketHelper::ByteArraySize>(dataSize(packet)));
+	appendTo(data, packet);
+	return data;
+}
+
+template<typename S, typename T>
+void CompactPacketCodec<S, T>::appendTo(QByteArray &data, const Packet &packet) const
+{
+	ensureFixedSizeMatches(packet);
+
+	const Type type{packet.header().type()};
+	const auto offset = data.size();
+	data.resize(offset + static_cast<GenericPacketHelper::ByteArraySize>(headerSize(type)));
+	char *header = data.data() + offset;
+	const auto networkType = GenericPacketHelper::hton(type.value);
+	std::memcpy(header, &networkType, sizeof(networkType));
+	if (!hasFixedSize(type))
+	{
+		const auto networkSize = GenericPacketHelper::hton(static_cast<S>(packet.payload().size()));
+		std::memcpy(header + sizeof(networkType), &networkSize, sizeof(networkSize));
+	}
+	data.append(packet.payload());
+}
+
+template<typename S, typename T>
+typename GenericPacket<S, T>::template Result<typename CompactPacketCodec<S, T>::View>
+CompactPacketCodec<S, T>::tryDecodeView(const char *data, std::size_t size, std::size_t maxPayloadSize) const
+{
+	T type;
+	if (size < sizeof(type))
+		return DecodeStatus::Incomplete;
+	std::memcpy(&type, data, sizeof(type));
+	type = GenericPacketHelper::ntoh(type);
+
+	S payloadSize;
+	const auto fixedSize = m_fixedSizes.find(type);
+	if (fixedSize != m_fixedSizes.end())
+	{
+		payloadSize = fixedSize->second;
+	}
+	else
+	{
+		if (size < sizeof(type) + sizeof(payloadSize))
+			return DecodeStatus::Incomplete;
+		std::memcpy(&payloadSize, data + sizeof(type), sizeof(payloadSize));
+		payloadSize = GenericPacketHelper::ntoh(payloadSize);
+	}
+
+	if (payloadSize > maxPayloadSize)
+		return DecodeStatus::Oversized;
+	const std::size_t headerSize = fixedSize != m_fixedSizes.end() ? sizeof(type) : sizeof(type) + sizeof(payloadSize);
+	if (size - headerSize < payloadSize)
+		return DecodeStatus::Incomplete;
+
+	return View{Header{Size{payloadSize}, Type{type}}, data + headerSize};
+}
+
+template<typename S, typename T>
+typename GenericPacket<S, T>::template Result<typename CompactPacketCodec<S, T>::View>
+CompactPacketCodec<S, T>::tryDecodeView(ConstData data, std::size_t maxPayloadSize) const
+{
+	return tryDecodeView(data.constData(), static_cast<std::size_t>(data.size()), maxPayloadSize);
+}
+
+template<typename S, typename T>
+typename GenericPacket<S, T>::template Result<typename CompactPacketCodec<S, T>::Packet>
+CompactPacketCodec<S, T>::tryExtract(QByteArray &data, std::size_t maxPayloadSize) const
+{
+	const auto view = tryDecodeView(data.constData(), static_cast<std::size_t>(data.size()), maxPayloadSize);
+	if (!view)
+		return view.status();
+
+	Packet packet = view->toPacket();
+	data.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(headerSize(Type{view->header.type()}) + view->payloadSize()));
+	return packet;
+}
+
+template<typename S, typename T>
+void CompactPacketCodec<S, T>::ensureFixedSizeMatches(const Packet &packet) const
+{
+	/* The payload is what gets written, whatever the header's size says: */
+	const auto fixedSize = m_fixedSizes.find(packet.header().type());
+	if (fixedSize != m_fixedSizes.end() && fixedSize->second != static_cast<std::size_t>(packet.payload().size()))
+		GENERICPACKET_THROW(std::length_error("The payload size does not match the fixed size of the packet type ("
+					+ std::to_string(fixedSize->second) + ")"));
+}
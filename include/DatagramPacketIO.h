@@ -0,0 +1,201 @@
+#pragma once
+#include "GenericPacket.h"
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
+
+/** \brief Receives packets sent one per datagram, many per system call
+ *
+ * Datagrams are received with recvmmsg() into one preallocated slab and
+ * decoded in place as GenericPacket::View. A datagram is only accepted if it
+ * holds exactly one complete packet, i.e. if its length equals the header
+ * size plus Header::size().
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class DatagramReceiver
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using View = typename Packet::View;
+
+	/** \brief Receive from \p socket, which is not taken ownership of
+	 *
+	 * Up to \p batchSize datagrams of at most \p maxDatagramSize bytes are
+	 * received per call to receive(). Longer datagrams are rejected.
+	 */
+	DatagramReceiver(int socket, std::size_t batchSize = 64, std::size_t maxDatagramSize = 65536);
+	DatagramReceiver(const DatagramReceiver &) = delete;
+	DatagramReceiver &operator=(const DatagramReceiver &) = delete;
+
+	/** \brief Receive a batch of datagrams with one system call
+	 *
+	 * \p function is called with the View of every valid packet. The views
+	 * are only valid until the next call to receive(). \p flags are passed
+	 * to recvmmsg(). The default blocks until at least one datagram arrives,
+	 * and then returns what is available. Use MSG_DONTWAIT to not block at
+	 * all. Returns the number of datagrams received, or -1 on error (errno is
+	 * then set).
+	 */
+	template<typename F>
+	int receive(F &&function, int flags = MSG_WAITFORONE);
+
+	/** \brief Number of datagrams rejected since construction */
+	std::size_t invalidDatagrams() const { return m_invalidDatagrams; }
+
+private:
+	int m_socket;
+	std::vector<char> m_slab;
+	std::vector<iovec> m_iovecs;
+	std::vector<mmsghdr> m_messages;
+	std::size_t m_invalidDatagrams = 0;
+};
+
+/** \brief Sends packets one per datagram, many per system call
+ *
+ * Packets are queued as a header and a pointer to their payload, and sent
+ * with sendmmsg() using one iovec for each, so payloads are never copied. The
+ * socket must be connected.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class DatagramSender
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Size = typename Packet::Size;
+	using Type = typename Packet::Type;
+
+	/** \brief Send to \p socket, which is not taken ownership of
+	 *
+	 * Up to \p batchSize packets are sent per system call.
+	 */
+	explicit DatagramSender(int socket, std::size_t batchSize = 64);
+	DatagramSender(const DatagramSender &) = delete;
+	DatagramSender &operator=(const DatagramSender &) = delete;
+
+	/** \brief Queue a packet, flushing first if the queue is full
+	 *
+	 * The payload is not copied and must stay valid until it is sent by
+	 * flush(). Returns false if the queue is full and could not be flushed.
+	 */
+	bool queue(Type type, const char *payload, std::size_t size);
+	bool queue(const Packet &packet);
+	/** \brief Send all queued packets
+	 *
+	 * Returns false (with errno set) if not all could be sent. Unsent
+	 * packets stay queued, e.g. after EAGAIN on a non-blocking socket.
+	 */
+	bool flush();
+
+	std::size_t queued() const { return m_count - m_sent; }
+
+private:
+	int m_socket;
+	std::vector<char> m_headers;
+	std::vector<iovec> m_iovecs;
+	std::vector<mmsghdr> m_messages;
+	std::size_t m_count = 0;
+	std::size_t m_sent = 0;
+};
+
+
+template<typename S, typename T>
+DatagramReceiver<S, T>::DatagramReceiver(int socket, std::size_t batchSize, std::size_t maxDatagramSize)
+	: m_socket(socket),
+	m_slab(batchSize * maxDatagramSize),
+	m_iovecs(batchSize),
+	m_messages(batchSize)
+{
+	for (std::size_t i = 0; i < batchSize; ++i)
+	{
+		m_iovecs[i] = { m_slab.data() + i * maxDatagramSize, maxDatagramSize };
+		m_messages[i].msg_hdr.msg_iov = &m_iovecs[i];
+		m_messages[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+template<typename S, typename T>
+template<typename F>
+int DatagramReceiver<S, T>::receive(F &&function, int flags)
+{
+	int received;
+	do
+		received = recvmmsg(m_socket, m_messages.data(), static_cast<unsigned int>(m_messages.size()),
+				flags, nullptr);
+	while (received < 0 && errno == EINTR);
+
+	for (int i = 0; i < received; ++i)
+	{
+		const mmsghdr &message = m_messages[static_cast<std::size_t>(i)];
+		const auto packet = Packet::tryDecodeView(
+				static_cast<const char *>(message.msg_hdr.msg_iov->iov_base), message.msg_len);
+		/* Truncated datagrams, incomplete packets and trailing bytes are all
+		 * signs of a broken sender: */
+		if (!packet || (message.msg_hdr.msg_flags & MSG_TRUNC) ||
+				Header::dataSize() + packet->payloadSize() != message.msg_len)
+		{
+			++m_invalidDatagrams;
+			continue;
+		}
+		function(*packet);
+	}
+	return received;
+}
+
+template<typename S, typename T>
+DatagramSender<S, T>::DatagramSender(int socket, std::size_t batchSize)
+	: m_socket(socket),
+	m_headers(batchSize * Header::dataSize()),
+	m_iovecs(2 * batchSize),
+	m_messages(batchSize)
+{
+	for (std::size_t i = 0; i < batchSize; ++i)
+	{
+		m_iovecs[2 * i] = { m_headers.data() + i * Header::dataSize(), Header::dataSize() };
+		m_messages[i].msg_hdr.msg_iov = &m_iovecs[2 * i];
+		m_messages[i].msg_hdr.msg_iovlen = 2;
+	}
+}
+
+template<typename S, typename T>
+bool DatagramSender<S, T>::queue(Type type, const char *payload, std::size_t size)
+{
+	GenericPacketHelper::ensureSizeCanHoldPayload(Header::maxSize(), size);
+	if (m_count == m_messages.size() && !flush())
+		return false;
+
+	Header{Size{static_cast<S>(size)}, type}.toData(m_headers.data() + m_count * Header::dataSize());
+	m_iovecs[2 * m_count + 1] = { const_cast<char *>(payload), size };
+	++m_count;
+	return true;
+}
+
+template<typename S, typename T>
+bool DatagramSender<S, T>::queue(const Packet &packet)
+{
+	return queue(Type{packet.header().type()}, packet.payload().constData(),
+			static_cast<std::size_t>(packet.payload().size()));
+}
+
+template<typename S, typename T>
+bool DatagramSender<S, T>::flush()
+{
+	while (m_sent < m_count)
+	{
+		const int sent = sendmmsg(m_socket, m_messages.data() + m_sent,
+				static_cast<unsigned int>(m_count - m_sent), MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		m_sent += static_cast<std::size_t>(sent);
+	}
+
+	m_count = 0;
+	m_sent = 0;
+	return true;
+}
@@ -0,0 +1,253 @@
+#pragma once
+#include "GenericPacket.h"
+#include <type_traits>
+
+namespace GenericPacketHelper
+{
+	/* How a field is encoded in a delta header, two bits per field: */
+	enum DeltaField : std::uint8_t
+	{
+		/* Same as in the previous header, nothing follows: */
+		DeltaSame = 0,
+		/* The difference to the previous header follows as one signed byte: */
+		DeltaByte = 1,
+		/* The field follows in full: */
+		DeltaFull = 2,
+	};
+
+	/* Encoding of value following previous, for a field that may be delta encoded: */
+	template<typename U>
+	inline DeltaField deltaField(U value, U previous, bool useDelta)
+	{
+		using Distance = typename std::make_signed<U>::type;
+		if (!useDelta)
+			return DeltaFull;
+		if (value == previous)
+			return DeltaSame;
+		const Distance distance = static_cast<Distance>(static_cast<U>(value - previous));
+		return sizeof(U) > 1 && distance >= -128 && distance <= 127 ? DeltaByte : DeltaFull;
+	}
+}
+
+/** \brief Encodes packet headers as differences to the previous header
+ *
+ * Every frame starts with a flags byte telling for the type and the size each
+ * whether it is the same as in the previous frame, differs by a value that
+ * follows in one signed byte, or follows in full (in network byte order). The
+ * payload comes next. A run of packets of the same type and size thus only
+ * takes one header byte per packet.
+ *
+ * The previous header is state shared by the encoder and DeltaHeaderDecoder,
+ * so frames must be decoded in the order they were encoded, without loss,
+ * e.g. over a stream socket. Both start out as if the previous header had
+ * been of type 0 and size 0, and must be reset() together, e.g. on
+ * reconnecting.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class DeltaHeaderEncoder
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+
+	/** \brief Delta encode sizes as well as types (the default) */
+	void setSizeDeltas(bool enabled) { m_sizeDeltas = enabled; }
+
+	/** \brief Encode \p packet, and remember its header for the next one */
+	QByteArray toData(const Packet &packet);
+	/** \brief Like toData(), but append to \p data */
+	void appendTo(QByteArray &data, const Packet &packet);
+
+	/** \brief Start over from a header of type 0 and size 0 */
+	void reset()
+	{
+		m_previousType = 0;
+		m_previousSize = 0;
+	}
+
+private:
+	bool m_sizeDeltas = true;
+	T m_previousType = 0;
+	S m_previousSize = 0;
+};
+
+/** \brief Decodes frames encoded by DeltaHeaderEncoder
+ *
+ * The previous header is remembered across calls, and only updated for
+ * frames that are decoded completely.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class DeltaHeaderDecoder
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using View = typename Packet::View;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	using ConstData = GenericPacketHelper::ConstData;
+
+	/** \brief Decode the next frame without copying its payload
+	 *
+	 * Returns the same statuses as GenericPacket::tryDecodeView(), and
+	 * DecodeStatus::Invalid for unknown flags. The view's payload points into
+	 * \p data, and the frame is lastFrameSize() bytes long. Frames must be
+	 * passed in order, each once.
+	 */
+	typename Packet::template Result<View> tryDecodeView(const char *data, std::size_t size,
+			std::size_t maxPayloadSize = Header::maxSize());
+	typename Packet::template Result<View> tryDecodeView(ConstData data,
+			std::size_t maxPayloadSize = Header::maxSize());
+	/** \brief Like tryDecodeView(), but copy the packet and remove its bytes from \p data */
+	typename Packet::template Result<Packet> tryExtract(QByteArray &data,
+			std::size_t maxPayloadSize = Header::maxSize());
+
+	/** \brief Size of the frame last decoded, header included */
+	std::size_t lastFrameSize() const { return m_lastFrameSize; }
+
+	/** \brief Start over from a header of type 0 and size 0 */
+	void reset()
+	{
+		m_previousType = 0;
+		m_previousSize = 0;
+	}
+
+private:
+	template<typename U>
+	static bool decodeField(GenericPacketHelper::DeltaField field, U previous, const char *&data,
+			std::size_t &size, U &value, DecodeStatus &status);
+
+	T m_previousType = 0;
+	S m_previousSize = 0;
+	std::size_t m_lastFrameSize = 0;
+};
+
+
+template<typename S, typename T>
+QByteArray DeltaHeaderEncoder<S, T>::toData(const Packet &packet)
+{
+	QByteArray data;
+	data.reserve(static_cast<GenericPacketHelper::ByteArraySize>(1 + sizeof(T) + sizeof(S)) + packet.payload().size());
+	appendTo(data, packet);
+	return data;
+}
+
+template<typename S, typename T>
+void DeltaHeaderEncoder<S, T>::appendTo(QByteArray &data, const Packet &packet)
+{
+	const T type = packet.header().type();
+	const S size = packet.header().size();
+	const auto typeField = GenericPacketHelper::deltaField(type, m_previousType, true);
+	const auto sizeField = GenericPacketHelper::deltaField(size, m_previousSize, m_sizeDeltas);
+
+	char header[1 + sizeof(T) + sizeof(S)];
+	std::size_t headerSize = 0;
+	header[headerSize++] = static_cast<char>(typeField | sizeField << 2);
+	if (typeField == GenericPacketHelper::DeltaByte)
+	{
+		header[headerSize++] = static_cast<char>(static_cast<T>(type - m_previousType));
+	}
+	else if (typeField == GenericPacketHelper::DeltaFull)
+	{
+		const auto networkType = GenericPacketHelper::hton(type);
+		std::memcpy(header + headerSize, &networkType, sizeof(networkType));
+		headerSize += sizeof(networkType);
+	}
+	if (sizeField == GenericPacketHelper::DeltaByte)
+	{
+		header[headerSize++] = static_cast<char>(static_cast<S>(size - m_previousSize));
+	}
+	else if (sizeField == GenericPacketHelper::DeltaFull)
+	{
+		const auto networkSize = GenericPacketHelper::hton(size);
+		std::memcpy(header + headerSize, &networkSize, sizeof(networkSize));
+		headerSize += sizeof(networkSize);
+	}
+
+	data.append(header, static_cast<GenericPacketHelper::ByteArraySize>(headerSize));
+	data.append(packet.payload());
+	m_previousType = type;
+	m_previousSize = size;
+}
+
+template<typename S, typename T>
+typename GenericPacket<S, T>::template Result<typename DeltaHeaderDecoder<S, T>::View>
+DeltaHeaderDecoder<S, T>::tryDecodeView(const char *data, std::size_t size, std::size_t maxPayloadSize)
+{
+	if (!size)
+		return DecodeStatus::Incomplete;
+
+	const auto flags = static_cast<std::uint8_t>(*data);
+	if (flags >> 4 || (flags & 3) > GenericPacketHelper::DeltaFull || (flags >> 2) > GenericPacketHelper::DeltaFull)
+		return DecodeStatus::Invalid;
+
+	const char *const begin = data;
+	++data;
+	--size;
+	T type;
+	S payloadSize;
+	DecodeStatus status = DecodeStatus::Ok;
+	if (!decodeField(static_cast<GenericPacketHelper::DeltaField>(flags & 3), m_previousType, data, size, type, status) ||
+			!decodeField(static_cast<GenericPacketHelper::DeltaField>(flags >> 2), m_previousSize, data, size, payloadSize, status))
+		return status;
+
+	if (payloadSize > maxPayloadSize)
+		return DecodeStatus::Oversized;
+	if (size < payloadSize)
+		return DecodeStatus::Incomplete;
+
+	m_previousType = type;
+	m_previousSize = payloadSize;
+	m_lastFrameSize = static_cast<std::size_t>(data - begin) + payloadSize;
+	return View{Header{typename Packet::Size{payloadSize}, typename Packet::Type{type}}, data};
+}
+
+template<typename S, typename T>
+typename GenericPacket<S, T>::template Result<typename DeltaHeaderDecoder<S, T>::View>
+DeltaHeaderDecoder<S, T>::tryDecodeView(ConstData data, std::size_t maxPayloadSize)
+{
+	return tryDecodeView(data.constData(), static_cast<std::size_t>(data.size()), maxPayloadSize);
+}
+
+template<typename S, typename T>
+typename GenericPacket<S, T>::template Result<typename DeltaHeaderDecoder<S, T>::Packet>
+DeltaHeaderDecoder<S, T>::tryExtract(QByteArray &data, std::size_t maxPayloadSize)
+{
+	const auto view = tryDecodeView(data.constData(), static_cast<std::size_t>(data.size()), maxPayloadSize);
+	if (!view)
+		return view.status();
+
+	Packet packet = view->toPacket();
+	data.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(m_lastFrameSize));
+	return packet;
+}
+
+template<typename S, typename T>
+template<typename U>
+bool DeltaHeaderDecoder<S, T>::decodeField(GenericPacketHelper::DeltaField field, U previous, const char *&data,
+		std::size_t &size, U &value, DecodeStatus &status)
+{
+	switch (field)
+	{
+	case GenericPacketHelper::DeltaSame:
+		value = previous;
+		return true;
+	case GenericPacketHelper::DeltaByte:
+		if (!size)
+			break;
+		value = static_cast<U>(previous + static_cast<U>(static_cast<signed char>(*data)));
+		++data;
+		--size;
+		return true;
+	case GenericPacketHelper::DeltaFull:
+		if (size < sizeof(value))
+			break;
+		std::memcpy(&value, data, sizeof(value));
+		value = GenericPacketHelper::ntoh(value);
+		data += sizeof(value);
+		size -= sizeof(value);
+		return true;
+	}
+
+	status = DecodeStatus::Incomplete;
+	return false;
+}
@@ -1,13 +1,65 @@
 #pragma once
 #include <cstdint>
 #include <QByteArray>
+#include <QtGlobal>
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+#include <QByteArrayView>
+#endif
 #include <cstddef>
+#include <cstring>
 #include <arpa/inet.h>
-#include <exception>
+#include <endian.h>
+#include <stdexcept>
+#include <string>
+#include <tuple>
 #include <memory>
 #include <limits>
+#include <utility>
 
-template<typename S = std::uint32_t, typename T = std::uint32_t>
+/* Errors are reported by throwing when exceptions are available. Builds using
+ * -fno-exceptions abort instead, and are expected to use the non-throwing
+ * try*() API: */
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#define GENERICPACKET_THROW(exception) throw exception
+#else
+#define GENERICPACKET_THROW(exception) qFatal("%s", (exception).what())
+#endif
+
+namespace GenericPacketHelper
+{
+	/* Integer type used by QByteArray for sizes and offsets (int with Qt 5,
+	 * qsizetype with Qt 6): */
+	using ByteArraySize = decltype(std::declval<QByteArray>().size());
+
+	/* Read-only raw data is taken as a QByteArrayView with Qt 6, which lets
+	 * callers pass any contiguous memory without wrapping or copying it: */
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+	using ConstData = QByteArrayView;
+#else
+	using ConstData = const QByteArray &;
+#endif
+
+	/* Throws a std::range_error if the size field, able to hold at most
+	 * maxSize, cannot hold size. The message is only put together when
+	 * actually failing: */
+	inline void ensureSizeCanHoldPayload(std::size_t maxSize, std::size_t size)
+	{
+		if (size > maxSize)
+			GENERICPACKET_THROW(std::range_error("The datatype chosen to represent the "
+						"packet length in the header (maximum value "
+						+ std::to_string(maxSize) + ") cannot hold the payload size ("
+						+ std::to_string(size) + ")"));
+	}
+}
+
+/** \brief A packet of a size, a type, any extra header fields and a payload
+ *
+ * Extra fields (e.g. a sequence number or a timestamp) are unsigned
+ * fixed-width integers following the type in the header, in the order they
+ * are given. They are read and written together with the rest of the header,
+ * so metadata does not have to be put into and parsed out of the payload.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t, typename... Extra>
 class GenericPacket
 {
 public:
@@ -22,46 +74,135 @@ public:
 	};
 	using Size = NamedType<S>;
 	using Type = NamedType<T>;
+	using ConstData = GenericPacketHelper::ConstData;
+
+	/** \brief Reason a non-throwing decode did or did not produce a value */
+	enum class DecodeStatus
+	{
+		Ok,
+		/* More bytes are needed: */
+		Incomplete,
+		/* The payload announced by the header exceeds the allowed size: */
+		Oversized,
+		/* The data cannot be a valid packet (only reported by components
+		 * that have means to tell): */
+		Invalid,
+	};
+
+	/** \brief Either a decoded value or the reason there is none
+	 *
+	 * Converts to true if and only if status() is DecodeStatus::Ok.
+	 */
+	template<typename V>
+	class Result
+	{
+	public:
+		Result(DecodeStatus status) : m_status(status), m_value() {}
+		Result(V value) : m_status(DecodeStatus::Ok), m_value(std::move(value)) {}
+
+		explicit operator bool() const { return m_status == DecodeStatus::Ok; }
+		DecodeStatus status() const { return m_status; }
+
+		V &value() { return m_value; }
+		const V &value() const { return m_value; }
+		V &operator*() { return m_value; }
+		const V &operator*() const { return m_value; }
+		V *operator->() { return &m_value; }
+		const V *operator->() const { return &m_value; }
+
+	private:
+		DecodeStatus m_status;
+		V m_value;
+	};
 
 	class Header
 	{
 	public:
+		/** \brief The type of the extra field at \p I */
+		template<std::size_t I>
+		using ExtraField = typename std::tuple_element<I, std::tuple<Extra...>>::type;
+
 		Header() = default;
 		Header(Size size, Type type);
 
 		/** \brief Check if data may contain a complete header */
-		static bool hasCompleteHeader(const QByteArray &data);
+		static bool hasCompleteHeader(ConstData data);
 
 		/** \brief Deep-copy a header from the given raw data
 		 *
 		 * Throws a std::length_error if the header is not complete.
 		 */
-		static Header fromData(const QByteArray &data);
+		static Header fromData(ConstData data);
 		/** \brief Extract bytes from the raw data and construct a header
 		 *
 		 * Throws a std::length_error if the header is not complete.
 		 */
 		static Header extractFromData(QByteArray &packet);
+		/** \brief Parse a header from the given raw data without throwing
+		 *
+		 * Returns DecodeStatus::Incomplete if the header is not complete.
+		 */
+		static Result<Header> tryDecode(ConstData data);
+		static Result<Header> tryDecode(const char *data, std::size_t size);
 
 		/** \brief Size of payload */
-		S size() const { return m_size; }
-		T type() const { return m_type; }
+		S size() const { return std::get<0>(m_fields); }
+		T type() const { return std::get<1>(m_fields); }
+		/** \brief The extra field at \p I (0 being the first after the type) */
+		template<std::size_t I>
+		ExtraField<I> extra() const { return std::get<I + 2>(m_fields); }
 
 		Header &setSize(Size size);
 		Header &setType(Type type);
+		template<std::size_t I>
+		Header &setExtra(ExtraField<I> value)
+		{
+			std::get<I + 2>(m_fields) = value;
+			return *this;
+		}
 
 		QByteArray toData() const;
+		/** \brief Write the header to the dataSize() bytes at \p data */
+		void toData(char *data) const;
 		static std::size_t dataSize();
 
 		/** \brief The largest payload size the size type can hold */
 		static std::size_t maxSize();
 
 	private:
-		explicit Header(const QByteArray &data);
-		explicit Header(QByteArray &data);
+		explicit Header(const char *data);
+
+		/* The size, the type and the extra fields: */
+		std::tuple<S, T, Extra...> m_fields{};
+	};
+
+	/** \brief Non-owning view of a packet whose payload lives elsewhere
+	 *
+	 * Only valid as long as the memory pointed to by payloadData is. An
+	 * aggregate, also in C++11, so it is created as View{header, payloadData}.
+	 */
+	struct View
+	{
+		Header header;
+		const char *payloadData;
 
-		S m_size = 0;
-		T m_type = 0;
+		std::size_t payloadSize() const { return header.size(); }
+		/** \brief A QByteArray sharing the viewed memory (see QByteArray::fromRawData()) */
+		QByteArray payload() const
+		{
+			return QByteArray::fromRawData(payloadData, static_cast<GenericPacketHelper::ByteArraySize>(header.size()));
+		}
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+		QByteArrayView payloadView() const
+		{
+			return QByteArrayView(payloadData, static_cast<qsizetype>(header.size()));
+		}
+#endif
+		/** \brief Deep-copy the viewed packet */
+		GenericPacket toPacket() const
+		{
+			return GenericPacket{header, QByteArray(payloadData, static_cast<GenericPacketHelper::ByteArraySize>(header.size()))};
+		}
 	};
 
 	GenericPacket() = default;
@@ -69,18 +210,61 @@ public:
 	GenericPacket(Type type, QByteArray &&payload);
 
 	/** \brief Check if data has a complete header and a complete payload */
-	static bool hasCompletePacket(const QByteArray &data);
+	static bool hasCompletePacket(ConstData data);
 	/** \brief Deep-copy a packet from the given raw data
 	 *
 	 * Throws a std::length_error if the packet is not complete.
 	 */
-	static GenericPacket fromData(const QByteArray &data);
+	static GenericPacket fromData(ConstData data);
+	/** \brief Construct a packet from raw data that is no longer needed
+	 *
+	 * If the packet spans all of \p data, its buffer is taken over by the
+	 * payload instead of being copied.
+	 *
+	 * Throws a std::length_error if the packet is not complete.
+	 */
+	static GenericPacket fromData(QByteArray &&data);
 	/** \brief Extract bytes from the raw data and construct a packet
 	 *
 	 * Throws a std::length_error if the packet is not complete.
 	 */
 	static GenericPacket extractFromData(QByteArray &packet);
 
+	/** \brief Parse a packet from the given raw data without throwing
+	 *
+	 * The header is parsed once. Returns DecodeStatus::Incomplete if the
+	 * packet is not complete, and DecodeStatus::Oversized if the header
+	 * announces a payload larger than \p maxPayloadSize (checked before
+	 * waiting for the payload to arrive).
+	 */
+	static Result<GenericPacket> tryDecode(ConstData data,
+			std::size_t maxPayloadSize = Header::maxSize());
+	/** \brief Like tryDecode(), but remove the packet's bytes from the raw data
+	 *
+	 * \p data is left untouched unless a packet is returned. If the packet
+	 * spans all of \p data, its buffer is taken over by the payload instead
+	 * of being copied, leaving \p data empty.
+	 */
+	static Result<GenericPacket> tryExtract(QByteArray &data,
+			std::size_t maxPayloadSize = Header::maxSize());
+	/** \brief Like tryDecode(), taking over the buffer of \p data if possible */
+	static Result<GenericPacket> tryDecode(QByteArray &&data,
+			std::size_t maxPayloadSize = Header::maxSize());
+	/** \brief Parse a packet without copying its payload
+	 *
+	 * Returns the same statuses as tryDecode(). The view's payload points into
+	 * \p data.
+	 */
+	static Result<View> tryDecodeView(ConstData data, std::size_t maxPayloadSize = Header::maxSize());
+	static Result<View> tryDecodeView(const char *data, std::size_t size,
+			std::size_t maxPayloadSize = Header::maxSize());
+	/** \brief Construct a packet without throwing
+	 *
+	 * Returns DecodeStatus::Oversized if the size type cannot hold the
+	 * payload size.
+	 */
+	static Result<GenericPacket> tryCreate(Type type, QByteArray payload);
+
 	Header &header() { return m_header; }
 	const Header &header() const { return m_header; }
 
@@ -94,8 +278,10 @@ public:
 	std::size_t dataSize() const;
 
 private:
-	explicit GenericPacket(const QByteArray &packet);
-	explicit GenericPacket(QByteArray &packet);
+	GenericPacket(const Header &header, QByteArray &&payload);
+	static Result<Header> tryDecodePacketHeader(ConstData data, std::size_t maxPayloadSize);
+	static GenericPacket takeRemainder(const Header &header, QByteArray &data);
+	static bool canHoldPayload(const QByteArray &payload);
 	void ensureSizeCanHoldPayload();
 
 	Header m_header;
@@ -120,6 +306,11 @@ namespace GenericPacketHelper
 		return ntohl(value);
 	}
 
+	inline std::uint64_t ntoh(std::uint64_t value)
+	{
+		return be64toh(value);
+	}
+
 	inline std::uint8_t hton(std::uint8_t value)
 	{
 		return value;
@@ -135,205 +326,380 @@ namespace GenericPacketHelper
 		return htonl(value);
 	}
 
+	inline std::uint64_t hton(std::uint64_t value)
+	{
+		return htobe64(value);
+	}
+
 #pragma pack(1)
-	template<typename S, typename T>
+	/* Fields in network byte order, one right after the other: */
+	template<typename First, typename... Rest>
+	struct RawFields
+	{
+		First first;
+		RawFields<Rest...> rest;
+
+		template<std::size_t I = 0, typename Tuple>
+		inline void load(Tuple &values) const
+		{
+			std::get<I>(values) = ntoh(first);
+			rest.template load<I + 1>(values);
+		}
+		template<std::size_t I = 0, typename Tuple>
+		inline void store(const Tuple &values)
+		{
+			first = hton(std::get<I>(values));
+			rest.template store<I + 1>(values);
+		}
+	};
+
+	template<typename Last>
+	struct RawFields<Last>
+	{
+		Last first;
+
+		template<std::size_t I = 0, typename Tuple>
+		inline void load(Tuple &values) const
+		{
+			std::get<I>(values) = ntoh(first);
+		}
+		template<std::size_t I = 0, typename Tuple>
+		inline void store(const Tuple &values)
+		{
+			first = hton(std::get<I>(values));
+		}
+	};
+
+	template<typename S, typename T, typename... Extra>
 	struct RawHeader
 	{
-		S size;
-		T type;
+		using Fields = std::tuple<S, T, Extra...>;
+
+		RawFields<S, T, Extra...> fields;
 
-		static inline RawHeader fromData(const QByteArray &data)
+		static inline Fields fromData(const char *data)
 		{
-			const RawHeader *header = reinterpret_cast<const RawHeader *>(data.constData());
-			return { ntoh(header->size), ntoh(header->type) };
+			const RawHeader *header = reinterpret_cast<const RawHeader *>(data);
+			Fields values;
+			header->fields.load(values);
+			return values;
 		}
-		static inline QByteArray toData(S size, T type)
+		static inline QByteArray toData(const Fields &values)
 		{
-			RawHeader<S, T> raw{ hton(size), hton(type) };
+			RawHeader raw;
+			raw.fields.store(values);
 			return { reinterpret_cast<const char *>(&raw), sizeof(raw) };
 		}
+		static inline void toData(const Fields &values, char *data)
+		{
+			RawHeader raw;
+			raw.fields.store(values);
+			std::memcpy(data, &raw, sizeof(raw));
+		}
 	};
 #pragma pack()
 }
 
 
-template<typename S, typename T>
-GenericPacket<S, T>::Header::Header(Size size, Type type)
-	: m_size(size),
-	m_type(type)
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...>::Header::Header(Size size, Type type)
 {
-	static_assert(std::is_pod<GenericPacketHelper::RawHeader<S, T>>::value, "RawHeader must be a POD type");
+	static_assert(std::is_pod<GenericPacketHelper::RawHeader<S, T, Extra...>>::value, "RawHeader must be a POD type");
+	std::get<0>(m_fields) = size.value;
+	std::get<1>(m_fields) = type.value;
 }
 
-template<typename S, typename T>
-bool GenericPacket<S, T>::Header::hasCompleteHeader(const QByteArray &data)
+template<typename S, typename T, typename... Extra>
+bool GenericPacket<S, T, Extra...>::Header::hasCompleteHeader(ConstData data)
 {
 	return static_cast<std::size_t>(data.size()) >= dataSize();
 }
 
-template<typename S, typename T>
-typename GenericPacket<S, T>::Header GenericPacket<S, T>::Header::fromData(const QByteArray &data)
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::Header GenericPacket<S, T, Extra...>::Header::fromData(ConstData data)
 {
 	if (!hasCompleteHeader(data))
-		throw std::length_error("Data is not big enough to contain a header");
+		GENERICPACKET_THROW(std::length_error("Data is not big enough to contain a header"));
 
-	return Header{data};
+	return Header{data.constData()};
 }
 
-template<typename S, typename T>
-typename GenericPacket<S, T>::Header GenericPacket<S, T>::Header::extractFromData(QByteArray &data)
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::Header GenericPacket<S, T, Extra...>::Header::extractFromData(QByteArray &data)
 {
-	if (!hasCompleteHeader(data))
-		throw std::length_error("Data is not big enough to contain a header");
+	const auto header = fromData(data);
+	data.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(dataSize()));
+	return header;
+}
+
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::template Result<typename GenericPacket<S, T, Extra...>::Header>
+GenericPacket<S, T, Extra...>::Header::tryDecode(ConstData data)
+{
+	return tryDecode(data.constData(), static_cast<std::size_t>(data.size()));
+}
+
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::template Result<typename GenericPacket<S, T, Extra...>::Header>
+GenericPacket<S, T, Extra...>::Header::tryDecode(const char *data, std::size_t size)
+{
+	if (size < dataSize())
+		return DecodeStatus::Incomplete;
 
 	return Header{data};
 }
 
-template<typename S, typename T>
-typename GenericPacket<S, T>::Header &GenericPacket<S, T>::Header::setSize(Size size)
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::Header &GenericPacket<S, T, Extra...>::Header::setSize(Size size)
 {
-	m_size = size;
+	std::get<0>(m_fields) = size.value;
 	return *this;
 }
 
-template<typename S, typename T>
-typename GenericPacket<S, T>::Header &GenericPacket<S, T>::Header::setType(Type type)
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::Header &GenericPacket<S, T, Extra...>::Header::setType(Type type)
 {
-	m_type = type;
+	std::get<1>(m_fields) = type.value;
 	return *this;
 }
 
-template<typename S, typename T>
-QByteArray GenericPacket<S, T>::Header::toData() const
+template<typename S, typename T, typename... Extra>
+QByteArray GenericPacket<S, T, Extra...>::Header::toData() const
 {
-	return GenericPacketHelper::RawHeader<S, T>::toData(m_size, m_type);
+	return GenericPacketHelper::RawHeader<S, T, Extra...>::toData(m_fields);
 }
 
-template<typename S, typename T>
-std::size_t GenericPacket<S, T>::Header::dataSize()
+template<typename S, typename T, typename... Extra>
+void GenericPacket<S, T, Extra...>::Header::toData(char *data) const
 {
-	return sizeof(GenericPacketHelper::RawHeader<S, T>);
+	GenericPacketHelper::RawHeader<S, T, Extra...>::toData(m_fields, data);
 }
 
-template<typename S, typename T>
-std::size_t GenericPacket<S, T>::Header::maxSize()
+template<typename S, typename T, typename... Extra>
+std::size_t GenericPacket<S, T, Extra...>::Header::dataSize()
 {
-	return std::numeric_limits<S>::max();
+	return sizeof(GenericPacketHelper::RawHeader<S, T, Extra...>);
 }
 
-template<typename S, typename T>
-GenericPacket<S, T>::Header::Header(const QByteArray &data)
-	: m_size(GenericPacketHelper::RawHeader<S, T>::fromData(data).size),
-	m_type(GenericPacketHelper::RawHeader<S, T>::fromData(data).type)
+template<typename S, typename T, typename... Extra>
+std::size_t GenericPacket<S, T, Extra...>::Header::maxSize()
 {
+	return std::numeric_limits<S>::max();
 }
 
-template<typename S, typename T>
-GenericPacket<S, T>::Header::Header(QByteArray &data)
-	: Header(static_cast<const QByteArray &>(data))
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...>::Header::Header(const char *data)
+	: m_fields(GenericPacketHelper::RawHeader<S, T, Extra...>::fromData(data))
 {
-	/* Ideally the data should be moved and not copied, then removed, but sadly
-	 * there is no API for this: */
-	data.remove(0, static_cast<int>(dataSize()));
 }
 
-template<typename S, typename T>
-GenericPacket<S, T>::GenericPacket(Type type, const QByteArray &payload)
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...>::GenericPacket(Type type, const QByteArray &payload)
 	: m_header(Size(static_cast<S>(payload.size())), type),
 	m_payload(payload)
 {
 	ensureSizeCanHoldPayload();
 }
 
-template<typename S, typename T>
-GenericPacket<S, T>::GenericPacket(Type type, QByteArray &&payload)
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...>::GenericPacket(Type type, QByteArray &&payload)
 	: m_header(Size(static_cast<S>(payload.size())), type),
 	m_payload(std::move(payload))
 {
 	ensureSizeCanHoldPayload();
 }
 
-template<typename S, typename T>
-bool GenericPacket<S, T>::hasCompletePacket(const QByteArray &data)
+template<typename S, typename T, typename... Extra>
+bool GenericPacket<S, T, Extra...>::hasCompletePacket(ConstData data)
 {
+	const auto header = Header::tryDecode(data);
 	return
-		Header::hasCompleteHeader(data) &&
+		header &&
 		/* Ensure that the data contains the whole payload, determined by the
 		 * size field in the header: */
-		static_cast<std::size_t>(data.size()) - Header::dataSize() >= Header::fromData(data).size();
+		static_cast<std::size_t>(data.size()) - Header::dataSize() >= header->size();
+}
+
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...> GenericPacket<S, T, Extra...>::fromData(ConstData data)
+{
+	auto packet = tryDecode(data);
+	if (!packet)
+		GENERICPACKET_THROW(std::length_error("Data is not big enough to contain a packet"));
+
+	return std::move(*packet);
+}
+
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...> GenericPacket<S, T, Extra...>::fromData(QByteArray &&data)
+{
+	auto packet = tryDecode(std::move(data));
+	if (!packet)
+		GENERICPACKET_THROW(std::length_error("Data is not big enough to contain a packet"));
+
+	return std::move(*packet);
 }
 
-template<typename S, typename T>
-GenericPacket<S, T> GenericPacket<S, T>::fromData(const QByteArray &data)
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...> GenericPacket<S, T, Extra...>::extractFromData(QByteArray &data)
 {
-	if (!hasCompletePacket(data))
-		throw std::length_error("Data is not big enough to contain a packet");
+	auto packet = tryExtract(data);
+	if (!packet)
+		GENERICPACKET_THROW(std::length_error("Data is not big enough to contain a packet"));
 
-	return GenericPacket<S, T>(data);
+	return std::move(*packet);
 }
 
-template<typename S, typename T>
-GenericPacket<S, T> GenericPacket<S, T>::extractFromData(QByteArray &data)
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::template Result<GenericPacket<S, T, Extra...>>
+GenericPacket<S, T, Extra...>::tryDecode(ConstData data, std::size_t maxPayloadSize)
 {
-	if (!hasCompletePacket(data))
-		throw std::length_error("Data is not big enough to contain a packet");
+	const auto header = tryDecodePacketHeader(data, maxPayloadSize);
+	if (!header)
+		return header.status();
+
+	return GenericPacket{*header,
+		QByteArray(data.constData() + Header::dataSize(),
+			static_cast<GenericPacketHelper::ByteArraySize>(header->size()))};
+}
 
-	return GenericPacket<S, T>(data);
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::template Result<GenericPacket<S, T, Extra...>>
+GenericPacket<S, T, Extra...>::tryDecode(QByteArray &&data, std::size_t maxPayloadSize)
+{
+	const auto header = tryDecodePacketHeader(data, maxPayloadSize);
+	if (!header)
+		return header.status();
+	if (Header::dataSize() + header->size() == static_cast<std::size_t>(data.size()))
+		return takeRemainder(*header, data);
+
+	return GenericPacket{*header,
+		QByteArray(data.constData() + Header::dataSize(),
+			static_cast<GenericPacketHelper::ByteArraySize>(header->size()))};
+}
+
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::template Result<GenericPacket<S, T, Extra...>>
+GenericPacket<S, T, Extra...>::tryExtract(QByteArray &data, std::size_t maxPayloadSize)
+{
+	const auto header = tryDecodePacketHeader(data, maxPayloadSize);
+	if (!header)
+		return header.status();
+	/* The common case of a read returning exactly one packet: */
+	if (Header::dataSize() + header->size() == static_cast<std::size_t>(data.size()))
+		return takeRemainder(*header, data);
+
+	GenericPacket packet{*header,
+		QByteArray(data.constData() + Header::dataSize(),
+			static_cast<GenericPacketHelper::ByteArraySize>(header->size()))};
+	data.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(packet.dataSize()));
+	return packet;
+}
+
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::template Result<typename GenericPacket<S, T, Extra...>::View>
+GenericPacket<S, T, Extra...>::tryDecodeView(ConstData data, std::size_t maxPayloadSize)
+{
+	return tryDecodeView(data.constData(), static_cast<std::size_t>(data.size()), maxPayloadSize);
 }
 
-template<typename S, typename T>
-GenericPacket<S, T> &GenericPacket<S, T>::setPayload(const QByteArray &payload)
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::template Result<typename GenericPacket<S, T, Extra...>::View>
+GenericPacket<S, T, Extra...>::tryDecodeView(const char *data, std::size_t size, std::size_t maxPayloadSize)
+{
+	const auto header = Header::tryDecode(data, size);
+	if (!header)
+		return header.status();
+	if (header->size() > maxPayloadSize)
+		return DecodeStatus::Oversized;
+	if (size - Header::dataSize() < header->size())
+		return DecodeStatus::Incomplete;
+
+	return View{*header, data + Header::dataSize()};
+}
+
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::template Result<GenericPacket<S, T, Extra...>>
+GenericPacket<S, T, Extra...>::tryCreate(Type type, QByteArray payload)
+{
+	if (!canHoldPayload(payload))
+		return DecodeStatus::Oversized;
+
+	return GenericPacket{Header{Size(static_cast<S>(payload.size())), type}, std::move(payload)};
+}
+
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...> &GenericPacket<S, T, Extra...>::setPayload(const QByteArray &payload)
 {
 	m_payload = payload;
 	m_header.setSize(Size{static_cast<S>(m_payload.size())});
 	return *this;
 }
 
-template<typename S, typename T>
-GenericPacket<S, T> &GenericPacket<S, T>::setPayload(QByteArray &&payload)
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...> &GenericPacket<S, T, Extra...>::setPayload(QByteArray &&payload)
 {
 	m_payload = std::move(payload);
 	m_header.setSize(Size{static_cast<S>(m_payload.size())});
 	return *this;
 }
 
-template<typename S, typename T>
-QByteArray GenericPacket<S, T>::toData() const
+template<typename S, typename T, typename... Extra>
+QByteArray GenericPacket<S, T, Extra...>::toData() const
 {
 	return m_header.toData() + m_payload;
 }
 
-template<typename S, typename T>
-std::size_t GenericPacket<S, T>::dataSize() const
+template<typename S, typename T, typename... Extra>
+std::size_t GenericPacket<S, T, Extra...>::dataSize() const
 {
 	return m_header.dataSize() + static_cast<std::size_t>(m_payload.size());
 }
 
-template<typename S, typename T>
-GenericPacket<S, T>::GenericPacket(const QByteArray &data)
-	: m_header(Header::fromData(data)),
-	m_payload(data.mid(static_cast<int>(Header::dataSize()), static_cast<int>(m_header.size())))
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...>::GenericPacket(const Header &header, QByteArray &&payload)
+	: m_header(header),
+	m_payload(std::move(payload))
+{
+}
+
+template<typename S, typename T, typename... Extra>
+typename GenericPacket<S, T, Extra...>::template Result<typename GenericPacket<S, T, Extra...>::Header>
+GenericPacket<S, T, Extra...>::tryDecodePacketHeader(ConstData data, std::size_t maxPayloadSize)
+{
+	const auto header = Header::tryDecode(data);
+	if (!header)
+		return header;
+	if (header->size() > maxPayloadSize)
+		return DecodeStatus::Oversized;
+	if (static_cast<std::size_t>(data.size()) - Header::dataSize() < header->size())
+		return DecodeStatus::Incomplete;
+
+	return header;
+}
+
+template<typename S, typename T, typename... Extra>
+GenericPacket<S, T, Extra...> GenericPacket<S, T, Extra...>::takeRemainder(const Header &header, QByteArray &data)
 {
+	/* Only the header is removed, and the payload then takes over the buffer.
+	 * With Qt 5 this moves the payload bytes within the buffer, but avoids
+	 * both allocation and copy. Qt 6 removes a prefix in O(1) by advancing the
+	 * start of the array, making this zero-copy: */
+	data.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(Header::dataSize()));
+	GenericPacket packet{header, std::move(data)};
+	data.clear();
+	return packet;
 }
 
-template<typename S, typename T>
-GenericPacket<S, T>::GenericPacket(QByteArray &data)
-	: m_header(Header::extractFromData(data)),
-	m_payload(data.left(static_cast<int>(m_header.size())))
+template<typename S, typename T, typename... Extra>
+bool GenericPacket<S, T, Extra...>::canHoldPayload(const QByteArray &payload)
 {
-	/* Ideally the data should be moved and not copied, then removed, but sadly
-	 * there is no API for this: */
-	data.remove(0, static_cast<int>(m_header.size()));
+	return static_cast<std::size_t>(payload.size()) <= Header::maxSize();
 }
 
-template<typename S, typename T>
-void GenericPacket<S, T>::ensureSizeCanHoldPayload()
+template<typename S, typename T, typename... Extra>
+void GenericPacket<S, T, Extra...>::ensureSizeCanHoldPayload()
 {
-	if (static_cast<std::size_t>(m_payload.size()) > Header::maxSize())
-		throw std::range_error(QObject::tr("The datatype chosen to represent the "
-					"packet length in the header (maximum value %2) cannot hold the payload "
-					"size (%3)")
-				.arg(Header::maxSize())
-				.arg(m_payload.size())
-				.toStdString());
+	GenericPacketHelper::ensureSizeCanHoldPayload(Header::maxSize(),
+			static_cast<std::size_t>(m_payload.size()));
 }
@@ -0,0 +1,421 @@
+#pragma once
+#include "GenericPacket.h"
+#include <cerrno>
+#include <deque>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/** \brief A memory-mapped memfd holding a payload
+ *
+ * Used by LargePayloadChannel for payloads that are passed as file
+ * descriptors instead of being sent through the socket.
+ */
+class MappedPayload
+{
+public:
+	MappedPayload() = default;
+	/** \brief Create a writable memfd of the given size
+	 *
+	 * Fill data() and pass the payload to LargePayloadChannel::send(). Check
+	 * isValid() (and errno) for failure.
+	 */
+	static MappedPayload create(std::size_t size);
+	/** \brief Map \p size bytes of \p fd read-only, taking ownership of \p fd */
+	static MappedPayload map(int fd, std::size_t size);
+
+	~MappedPayload() { reset(); }
+	MappedPayload(MappedPayload &&other) noexcept { *this = std::move(other); }
+	MappedPayload &operator=(MappedPayload &&other) noexcept;
+	MappedPayload(const MappedPayload &) = delete;
+	MappedPayload &operator=(const MappedPayload &) = delete;
+
+	bool isValid() const { return m_fd >= 0; }
+	int fd() const { return m_fd; }
+	char *data() { return m_data; }
+	const char *constData() const { return m_data; }
+	std::size_t size() const { return m_size; }
+	/** \brief A QByteArray over the mapping, valid while this object lives */
+	QByteArray payload() const
+	{
+		return QByteArray::fromRawData(m_data, static_cast<GenericPacketHelper::ByteArraySize>(m_size));
+	}
+
+	/** \brief Unmap the payload and hand over the file descriptor */
+	int release();
+
+private:
+	MappedPayload(int fd, char *data, std::size_t size) : m_fd(fd), m_data(data), m_size(size) {}
+	void reset();
+
+	int m_fd = -1;
+	char *m_data = nullptr;
+	std::size_t m_size = 0;
+};
+
+/** \brief Packet channel over a Unix domain stream socket that passes large
+ * payloads as memfds
+ *
+ * Payloads up to a threshold are sent as ordinary frames, with the header and
+ * payload gathered in one sendmsg() instead of being concatenated. Larger
+ * payloads are put in a sealed memfd whose file descriptor is passed with
+ * SCM_RIGHTS. Its frame has a reserved marker type, and its payload holds the
+ * real type and the length of the payload, which may exceed what the size
+ * type can represent. The receiver maps the memfd and presents the mapping as
+ * the payload, so no payload bytes go through the socket.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class LargePayloadChannel
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Size = typename Packet::Size;
+	using Type = typename Packet::Type;
+	using DecodeStatus = typename Packet::DecodeStatus;
+
+	struct Message
+	{
+		T type = 0;
+		/** \brief The payload, sharing mapping's memory if passed as a memfd */
+		QByteArray payload;
+		MappedPayload mapping;
+	};
+
+	/** \brief Use the connected socket \p socket, which is not taken ownership of
+	 *
+	 * Frames of type \p markerType are reserved for passing memfds, which is
+	 * done for payloads larger than \p threshold bytes.
+	 */
+	LargePayloadChannel(int socket, Type markerType, std::size_t threshold);
+	~LargePayloadChannel();
+	LargePayloadChannel(const LargePayloadChannel &) = delete;
+	LargePayloadChannel &operator=(const LargePayloadChannel &) = delete;
+
+	/** \brief Send a payload, using a memfd if it is above the threshold
+	 *
+	 * Returns false (with errno set) on failure. Throws a std::range_error if
+	 * \p type is the marker type.
+	 */
+	bool send(Type type, const char *payload, std::size_t size);
+	bool send(const Packet &packet);
+	/** \brief Send a payload already written to a memfd, whatever its size
+	 *
+	 * Returns false (with errno set) on failure, and throws like the other
+	 * overload.
+	 */
+	bool send(Type type, MappedPayload &&payload);
+
+	/** \brief Read once from the socket, receiving any passed memfds
+	 *
+	 * Returns false on end of file or error (errno is then set).
+	 */
+	bool receive();
+	/** \brief Take the next complete message out of the received data
+	 *
+	 * Returns DecodeStatus::Invalid if a memfd frame is malformed, or the
+	 * passed memfd is missing, unsealed or too small.
+	 */
+	typename Packet::template Result<Message> tryRead();
+
+private:
+	static std::size_t descriptorSize() { return sizeof(std::uint64_t) + sizeof(T); }
+	bool sendFrame(const Header &header, const char *payload, int fd);
+
+	int m_socket;
+	T m_markerType;
+	std::size_t m_threshold;
+	QByteArray m_buffer;
+	/* Received file descriptors not yet matched with their frame: */
+	std::deque<int> m_fds;
+};
+
+
+inline MappedPayload MappedPayload::create(std::size_t size)
+{
+	const int fd = memfd_create("GenericPacket payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return {};
+	if (ftruncate(fd, static_cast<off_t>(size)) < 0)
+	{
+		const int error = errno;
+		close(fd);
+		errno = error;
+		return {};
+	}
+
+	void *data = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : nullptr;
+	if (data == MAP_FAILED)
+	{
+		const int error = errno;
+		close(fd);
+		errno = error;
+		return {};
+	}
+	return {fd, static_cast<char *>(data), size};
+}
+
+inline MappedPayload MappedPayload::map(int fd, std::size_t size)
+{
+	void *data = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+	if (data == MAP_FAILED)
+	{
+		const int error = errno;
+		close(fd);
+		errno = error;
+		return {};
+	}
+	return {fd, static_cast<char *>(data), size};
+}
+
+inline MappedPayload &MappedPayload::operator=(MappedPayload &&other) noexcept
+{
+	if (this != &other)
+	{
+		reset();
+		std::swap(m_fd, other.m_fd);
+		std::swap(m_data, other.m_data);
+		std::swap(m_size, other.m_size);
+	}
+	return *this;
+}
+
+inline int MappedPayload::release()
+{
+	if (m_data)
+		munmap(m_data, m_size);
+
+	const int fd = m_fd;
+	m_fd = -1;
+	m_data = nullptr;
+	m_size = 0;
+	return fd;
+}
+
+inline void MappedPayload::reset()
+{
+	const int fd = release();
+	if (fd >= 0)
+		close(fd);
+}
+
+
+template<typename S, typename T>
+LargePayloadChannel<S, T>::LargePayloadChannel(int socket, Type markerType, std::size_t threshold)
+	: m_socket(socket),
+	m_markerType(markerType),
+	m_threshold(threshold)
+{
+}
+
+template<typename S, typename T>
+LargePayloadChannel<S, T>::~LargePayloadChannel()
+{
+	for (const int fd : m_fds)
+		close(fd);
+}
+
+template<typename S, typename T>
+bool LargePayloadChannel<S, T>::send(Type type, const char *payload, std::size_t size)
+{
+	if (type.value == m_markerType)
+		GENERICPACKET_THROW(std::range_error("The marker type is reserved"));
+
+	if (size <= m_threshold && size <= Header::maxSize())
+		return sendFrame(Header{Size{static_cast<S>(size)}, type}, payload, -1);
+
+	auto mapping = MappedPayload::create(size);
+	if (!mapping.isValid())
+		return false;
+
+	std::memcpy(mapping.data(), payload, size);
+	return send(type, std::move(mapping));
+}
+
+template<typename S, typename T>
+bool LargePayloadChannel<S, T>::send(const Packet &packet)
+{
+	return send(Type{packet.header().type()}, packet.payload().constData(),
+			static_cast<std::size_t>(packet.payload().size()));
+}
+
+template<typename S, typename T>
+bool LargePayloadChannel<S, T>::send(Type type, MappedPayload &&payload)
+{
+	if (type.value == m_markerType)
+		GENERICPACKET_THROW(std::range_error("The marker type is reserved"));
+
+	const auto size = static_cast<std::uint64_t>(payload.size());
+	const int fd = payload.release();
+	/* Writable mappings are gone, so the memfd can be sealed. This guarantees
+	 * the receiver that the payload can neither change nor shrink under its
+	 * mapping: */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+	{
+		const int error = errno;
+		close(fd);
+		errno = error;
+		return false;
+	}
+
+	char descriptor[sizeof(std::uint64_t) + sizeof(T)];
+	const auto networkSize = GenericPacketHelper::hton(size);
+	const auto networkType = GenericPacketHelper::hton(type.value);
+	std::memcpy(descriptor, &networkSize, sizeof(networkSize));
+	std::memcpy(descriptor + sizeof(networkSize), &networkType, sizeof(networkType));
+
+	const bool sent = sendFrame(Header{Size{static_cast<S>(descriptorSize())}, Type{m_markerType}},
+			descriptor, fd);
+	const int error = errno;
+	close(fd);
+	errno = error;
+	return sent;
+}
+
+template<typename S, typename T>
+bool LargePayloadChannel<S, T>::receive()
+{
+	static constexpr std::size_t readSize = 64 * 1024;
+	static constexpr std::size_t maxFds = 16;
+
+	const auto used = m_buffer.size();
+	m_buffer.resize(used + static_cast<GenericPacketHelper::ByteArraySize>(readSize));
+
+	iovec iov{ m_buffer.data() + used, readSize };
+	alignas(cmsghdr) char control[CMSG_SPACE(maxFds * sizeof(int))];
+	msghdr message{};
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t received;
+	do
+		received = recvmsg(m_socket, &message, MSG_CMSG_CLOEXEC);
+	while (received < 0 && errno == EINTR);
+
+	m_buffer.resize(used + (received > 0 ? static_cast<GenericPacketHelper::ByteArraySize>(received) : 0));
+	if (received <= 0)
+		return false;
+
+	for (cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+	{
+		if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		const std::size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			int fd;
+			std::memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+			m_fds.push_back(fd);
+		}
+	}
+	return true;
+}
+
+template<typename S, typename T>
+typename GenericPacket<S, T>::template Result<typename LargePayloadChannel<S, T>::Message>
+LargePayloadChannel<S, T>::tryRead()
+{
+	auto packet = Packet::tryExtract(m_buffer);
+	if (!packet)
+		return packet.status();
+
+	Message message;
+	if (packet->header().type() != m_markerType)
+	{
+		message.type = packet->header().type();
+		message.payload = std::move(packet->payload());
+		return message;
+	}
+
+	/* File descriptors arrive in the order of their frames: */
+	if (static_cast<std::size_t>(packet->payload().size()) != descriptorSize() || m_fds.empty())
+		return DecodeStatus::Invalid;
+
+	const int fd = m_fds.front();
+	m_fds.pop_front();
+
+	std::uint64_t size;
+	std::memcpy(&size, packet->payload().constData(), sizeof(size));
+	size = GenericPacketHelper::ntoh(size);
+	std::memcpy(&message.type, packet->payload().constData() + sizeof(size), sizeof(T));
+	message.type = GenericPacketHelper::ntoh(message.type);
+
+	/* Only trust memfds that can never shrink below the announced size, as
+	 * that would turn accesses to the mapping into SIGBUS: */
+	struct stat status;
+	const int seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &status) < 0 ||
+			static_cast<std::uint64_t>(status.st_size) < size)
+	{
+		close(fd);
+		return DecodeStatus::Invalid;
+	}
+
+	message.mapping = MappedPayload::map(fd, static_cast<std::size_t>(size));
+	if (!message.mapping.isValid())
+		return DecodeStatus::Invalid;
+
+	message.payload = message.mapping.payload();
+	return message;
+}
+
+template<typename S, typename T>
+bool LargePayloadChannel<S, T>::sendFrame(const Header &header, const char *payload, int fd)
+{
+	char headerData[sizeof(GenericPacketHelper::RawHeader<S, T>)];
+	header.toData(headerData);
+
+	iovec iov[2] = {
+		{ headerData, sizeof(headerData) },
+		{ const_cast<char *>(payload), header.size() },
+	};
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	msghdr message{};
+	message.msg_iov = iov;
+	message.msg_iovlen = 2;
+	if (fd >= 0)
+	{
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		cmsghdr *controlHeader = CMSG_FIRSTHDR(&message);
+		controlHeader->cmsg_level = SOL_SOCKET;
+		controlHeader->cmsg_type = SCM_RIGHTS;
+		controlHeader->cmsg_len = CMSG_LEN(sizeof(int));
+		std::memcpy(CMSG_DATA(controlHeader), &fd, sizeof(int));
+	}
+
+	/* Stream sockets may accept only part of the data. The file descriptor
+	 * goes with the first part: */
+	while (message.msg_iovlen)
+	{
+		const ssize_t sent = sendmsg(m_socket, &message, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		message.msg_control = nullptr;
+		message.msg_controllen = 0;
+
+		auto remaining = static_cast<std::size_t>(sent);
+		while (message.msg_iovlen && remaining >= message.msg_iov->iov_len)
+		{
+			remaining -= message.msg_iov->iov_len;
+			++message.msg_iov;
+			--message.msg_iovlen;
+		}
+		if (message.msg_iovlen)
+		{
+			message.msg_iov->iov_base = static_cast<char *>(message.msg_iov->iov_base) + remaining;
+			message.msg_iov->iov_len -= remaining;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,180 @@
+#pragma once
+#include "GenericPacket.h"
+#include <iterator>
+#include <vector>
+
+/** \brief Structure-of-arrays container for many packets
+ *
+ * Headers are kept as contiguous arrays of sizes, types and payload offsets,
+ * and all payloads are stored back to back in a single slab. Appending a
+ * packet therefore costs no allocation once the batch has grown to its
+ * working size, and clear() keeps all capacity for the next batch.
+ *
+ * Packets are accessed as GenericPacket::View, which point into the slab and
+ * are invalidated by any modification of the batch.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketBatch
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Size = typename Packet::Size;
+	using Type = typename Packet::Type;
+	using View = typename Packet::View;
+	using DecodeStatus = typename Packet::DecodeStatus;
+
+	class const_iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = View;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = View;
+
+		const_iterator(const PacketBatch *batch, std::size_t index) : m_batch(batch), m_index(index) {}
+
+		View operator*() const { return m_batch->at(m_index); }
+		const_iterator &operator++() { ++m_index; return *this; }
+		const_iterator operator++(int) { auto it = *this; ++m_index; return it; }
+		bool operator==(const const_iterator &other) const { return m_index == other.m_index; }
+		bool operator!=(const const_iterator &other) const { return m_index != other.m_index; }
+
+	private:
+		const PacketBatch *m_batch;
+		std::size_t m_index;
+	};
+
+	/** \brief Reserve room for \p packets packets with \p payloadBytes bytes of payload in total */
+	void reserve(std::size_t packets, std::size_t payloadBytes);
+	/** \brief Remove all packets, but keep the allocated memory */
+	void clear();
+
+	std::size_t size() const { return m_types.size(); }
+	bool isEmpty() const { return m_types.empty(); }
+	/** \brief Total number of payload bytes in the batch */
+	std::size_t payloadBytes() const { return m_slab.size(); }
+
+	void append(const Header &header, const char *payload);
+	void append(const Packet &packet);
+	void append(const View &packet);
+	/** \brief Move all complete packets from the raw data into the batch
+	 *
+	 * The consumed bytes are removed from \p data in one go. Returns why
+	 * decoding stopped: DecodeStatus::Incomplete once \p data does not hold a
+	 * complete packet, or DecodeStatus::Oversized if the next packet's payload
+	 * is larger than \p maxPayloadSize (it is left in \p data).
+	 */
+	DecodeStatus extractFromData(QByteArray &data, std::size_t maxPayloadSize = Header::maxSize());
+
+	View at(std::size_t index) const;
+	View operator[](std::size_t index) const { return at(index); }
+	const_iterator begin() const { return {this, 0}; }
+	const_iterator end() const { return {this, size()}; }
+
+	/** \brief The type of every packet, in order */
+	const std::vector<T> &types() const { return m_types; }
+	/** \brief The payload size of every packet, in order */
+	const std::vector<S> &sizes() const { return m_sizes; }
+
+	/** \brief Number of packets of the given type */
+	std::size_t count(Type type) const;
+	/** \brief Call \p function with the View of every packet of the given type */
+	template<typename F>
+	void forEachOfType(Type type, F &&function) const;
+
+private:
+	std::vector<S> m_sizes;
+	std::vector<T> m_types;
+	std::vector<std::size_t> m_offsets;
+	std::vector<char> m_slab;
+};
+
+
+template<typename S, typename T>
+void PacketBatch<S, T>::reserve(std::size_t packets, std::size_t payloadBytes)
+{
+	m_sizes.reserve(packets);
+	m_types.reserve(packets);
+	m_offsets.reserve(packets);
+	m_slab.reserve(payloadBytes);
+}
+
+template<typename S, typename T>
+void PacketBatch<S, T>::clear()
+{
+	/* std::vector::clear() never releases capacity: */
+	m_sizes.clear();
+	m_types.clear();
+	m_offsets.clear();
+	m_slab.clear();
+}
+
+template<typename S, typename T>
+void PacketBatch<S, T>::append(const Header &header, const char *payload)
+{
+	m_sizes.push_back(header.size());
+	m_types.push_back(header.type());
+	m_offsets.push_back(m_slab.size());
+	m_slab.insert(m_slab.end(), payload, payload + header.size());
+}
+
+template<typename S, typename T>
+void PacketBatch<S, T>::append(const Packet &packet)
+{
+	append(packet.header(), packet.payload().constData());
+}
+
+template<typename S, typename T>
+void PacketBatch<S, T>::append(const View &packet)
+{
+	append(packet.header, packet.payloadData);
+}
+
+template<typename S, typename T>
+typename PacketBatch<S, T>::DecodeStatus PacketBatch<S, T>::extractFromData(
+		QByteArray &data, std::size_t maxPayloadSize)
+{
+	const char *begin = data.constData();
+	std::size_t remaining = static_cast<std::size_t>(data.size());
+
+	auto packet = Packet::tryDecodeView(begin, remaining, maxPayloadSize);
+	while (packet)
+	{
+		append(*packet);
+		begin += Header::dataSize() + packet->payloadSize();
+		remaining -= Header::dataSize() + packet->payloadSize();
+		packet = Packet::tryDecodeView(begin, remaining, maxPayloadSize);
+	}
+
+	data.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(begin - data.constData()));
+	return packet.status();
+}
+
+template<typename S, typename T>
+typename PacketBatch<S, T>::View PacketBatch<S, T>::at(std::size_t index) const
+{
+	return View{Header{Size{m_sizes[index]}, Type{m_types[index]}}, m_slab.data() + m_offsets[index]};
+}
+
+template<typename S, typename T>
+std::size_t PacketBatch<S, T>::count(Type type) const
+{
+	std::size_t count = 0;
+	for (const auto t : m_types)
+		count += t == type.value;
+
+	return count;
+}
+
+template<typename S, typename T>
+template<typename F>
+void PacketBatch<S, T>::forEachOfType(Type type, F &&function) const
+{
+	/* Only the contiguous type array is scanned, payloads are not touched
+	 * unless they match: */
+	for (std::size_t i = 0; i < m_types.size(); ++i)
+		if (m_types[i] == type.value)
+			function(at(i));
+}
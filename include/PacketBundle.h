@@ -0,0 +1,325 @@
+#pragma once
+#include "GenericPacket.h"
+#include <vector>
+
+namespace GenericPacketHelper
+{
+	/* CRC-32 (as used by zlib and Ethernet) of size bytes at data: */
+	inline std::uint32_t crc32(const char *data, std::size_t size)
+	{
+		struct Table
+		{
+			std::uint32_t entries[256];
+			Table()
+			{
+				for (std::uint32_t byte = 0; byte < 256; ++byte)
+				{
+					std::uint32_t crc = byte;
+					for (int bit = 0; bit < 8; ++bit)
+						crc = crc & 1 ? 0xedb88320u ^ (crc >> 1) : crc >> 1;
+					entries[byte] = crc;
+				}
+			}
+		};
+		static const Table table;
+
+		std::uint32_t crc = 0xffffffffu;
+		for (std::size_t i = 0; i < size; ++i)
+			crc = table.entries[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+		return crc ^ 0xffffffffu;
+	}
+}
+
+/** \brief Bundles many small packets into one packet of a reserved type
+ *
+ * The bundle's payload starts with a flags byte and the number of packets,
+ * followed by a CRC-32 if enabled. Then comes an index of the packets' types
+ * and sizes, and all their payloads back to back. The index and payloads may
+ * be compressed with qCompress(), which is only used if it makes them smaller.
+ * The checksum covers everything after it, as sent, so a corrupted bundle is
+ * rejected before it is decompressed.
+ *
+ * Checksumming, compressing and the bundle's header are thus paid once per
+ * bundle rather than once per packet. PacketUnbundler unpacks bundles into
+ * views.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketBundler
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	using View = typename Packet::View;
+
+	explicit PacketBundler(Type bundleType) : m_bundleType(bundleType.value) {}
+
+	/** \brief Compress bundles with qCompress() at \p level (0, the default, disables it) */
+	void setCompressionLevel(int level) { m_compressionLevel = level; }
+	/** \brief Add a CRC-32 to bundles (disabled by default) */
+	void setChecksum(bool enabled) { m_checksum = enabled; }
+
+	/** \brief Add a packet to the bundle
+	 *
+	 * Returns false, without adding it, if the bundle's payload would get
+	 * too large for the size type. take() the bundle and add the packet to
+	 * the next one then.
+	 */
+	bool append(Type type, const char *payload, std::size_t size);
+	bool append(const Packet &packet)
+	{
+		return append(Type{packet.header().type()}, packet.payload().constData(), static_cast<std::size_t>(packet.payload().size()));
+	}
+	bool append(const View &packet) { return append(Type{packet.header.type()}, packet.payloadData, packet.payloadSize()); }
+
+	bool isEmpty() const { return m_count == 0; }
+	std::size_t count() const { return m_count; }
+	/** \brief Size of the bundle's payload before compression */
+	std::size_t payloadSize() const
+	{
+		return prefixSize() + static_cast<std::size_t>(m_index.size()) + static_cast<std::size_t>(m_payloads.size());
+	}
+
+	/** \brief Take the bundle of all packets added, and start a new one */
+	Packet take();
+	void clear();
+
+	static std::size_t entrySize() { return sizeof(T) + sizeof(S); }
+
+private:
+	std::size_t prefixSize() const { return sizeof(std::uint8_t) + sizeof(std::uint32_t) + (m_checksum ? sizeof(std::uint32_t) : 0); }
+
+	T m_bundleType;
+	int m_compressionLevel = 0;
+	bool m_checksum = false;
+	std::uint32_t m_count = 0;
+	QByteArray m_index;
+	QByteArray m_payloads;
+};
+
+/** \brief Unpacks bundles made by PacketBundler into views
+ *
+ * The views point into the bundle's payload, or into a buffer of the
+ * unbundler for compressed bundles, and never outlive the next unpack(). When
+ * unpacking a Packet, its payload is shared, so that the views outlive the
+ * packet. When unpacking a View of an uncompressed bundle, they point into the
+ * caller's memory, and are only valid as long as that is as well.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketUnbundler
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	using View = typename Packet::View;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	using const_iterator = typename std::vector<View>::const_iterator;
+
+	/** \brief Unpack bundles of \p bundleType of at most \p maxUncompressedSize bytes */
+	explicit PacketUnbundler(Type bundleType, std::size_t maxUncompressedSize = Header::maxSize())
+		: m_bundleType(bundleType.value), m_maxUncompressedSize(maxUncompressedSize) {}
+
+	bool isBundle(const Header &header) const { return header.type() == m_bundleType; }
+
+	/** \brief Unpack \p bundle, replacing the previous bundle's views
+	 *
+	 * See the class description for how long the views stay valid. Returns DecodeStatus::Invalid if the bundle is malformed or its
+	 * checksum does not match, and DecodeStatus::Oversized if it decompresses
+	 * to more than the maximum size. No views are left in both cases.
+	 */
+	DecodeStatus unpack(const Packet &bundle);
+	DecodeStatus unpack(const View &bundle);
+
+	std::size_t size() const { return m_views.size(); }
+	bool isEmpty() const { return m_views.empty(); }
+	const View &at(std::size_t index) const { return m_views.at(index); }
+	const View &operator[](std::size_t index) const { return m_views[index]; }
+	const_iterator begin() const { return m_views.begin(); }
+	const_iterator end() const { return m_views.end(); }
+
+private:
+	DecodeStatus unpack(const char *data, std::size_t size);
+	DecodeStatus unpackBody(const char *data, std::size_t size, std::uint32_t count);
+
+	T m_bundleType;
+	std::size_t m_maxUncompressedSize;
+	/* Keeps the viewed bundle or decompressed data alive: */
+	QByteArray m_data;
+	std::vector<View> m_views;
+};
+
+
+namespace GenericPacketHelper
+{
+	enum BundleFlag : std::uint8_t
+	{
+		BundleCompressed = 1,
+		BundleChecksummed = 2,
+	};
+}
+
+template<typename S, typename T>
+bool PacketBundler<S, T>::append(Type type, const char *payload, std::size_t size)
+{
+	if (size > Header::maxSize() || payloadSize() + entrySize() + size > Header::maxSize())
+		return false;
+
+	char entry[sizeof(T) + sizeof(S)];
+	const auto networkType = GenericPacketHelper::hton(type.value);
+	const auto networkSize = GenericPacketHelper::hton(static_cast<S>(size));
+	std::memcpy(entry, &networkType, sizeof(networkType));
+	std::memcpy(entry + sizeof(networkType), &networkSize, sizeof(networkSize));
+	m_index.append(entry, static_cast<GenericPacketHelper::ByteArraySize>(sizeof(entry)));
+	m_payloads.append(payload, static_cast<GenericPacketHelper::ByteArraySize>(size));
+	++m_count;
+	return true;
+}
+
+template<typename S, typename T>
+typename PacketBundler<S, T>::Packet PacketBundler<S, T>::take()
+{
+	std::uint8_t flags = m_checksum ? GenericPacketHelper::BundleChecksummed : 0;
+	QByteArray body = m_index + m_payloads;
+	if (m_compressionLevel)
+	{
+		QByteArray compressed = qCompress(body, m_compressionLevel);
+		if (compressed.size() < body.size())
+		{
+			body = std::move(compressed);
+			flags |= GenericPacketHelper::BundleCompressed;
+		}
+	}
+
+	QByteArray payload;
+	payload.resize(static_cast<GenericPacketHelper::ByteArraySize>(prefixSize()));
+	char *data = payload.data();
+	const auto networkCount = GenericPacketHelper::hton(m_count);
+	std::memcpy(data, &flags, sizeof(flags));
+	std::memcpy(data + sizeof(flags), &networkCount, sizeof(networkCount));
+	if (m_checksum)
+	{
+		const auto networkChecksum = GenericPacketHelper::hton(GenericPacketHelper::crc32(body.constData(),
+					static_cast<std::size_t>(body.size())));
+		std::memcpy(data + sizeof(flags) + sizeof(networkCount), &networkChecksum, sizeof(networkChecksum));
+	}
+	payload.append(body);
+
+	clear();
+	return Packet{Type{m_bundleType}, std::move(payload)};
+}
+
+template<typename S, typename T>
+void PacketBundler<S, T>::clear()
+{
+	m_count = 0;
+	m_index.clear();
+	m_payloads.clear();
+}
+
+template<typename S, typename T>
+typename PacketUnbundler<S, T>::DecodeStatus PacketUnbundler<S, T>::unpack(const Packet &bundle)
+{
+	if (!isBundle(bundle.header()))
+		return DecodeStatus::Invalid;
+
+	m_data = bundle.payload();
+	return unpack(m_data.constData(), static_cast<std::size_t>(m_data.size()));
+}
+
+template<typename S, typename T>
+typename PacketUnbundler<S, T>::DecodeStatus PacketUnbundler<S, T>::unpack(const View &bundle)
+{
+	if (!isBundle(bundle.header))
+		return DecodeStatus::Invalid;
+
+	m_data.clear();
+	return unpack(bundle.payloadData, bundle.payloadSize());
+}
+
+template<typename S, typename T>
+typename PacketUnbundler<S, T>::DecodeStatus PacketUnbundler<S, T>::unpack(const char *data, std::size_t size)
+{
+	m_views.clear();
+
+	std::uint8_t flags;
+	std::uint32_t count;
+	if (size < sizeof(flags) + sizeof(count))
+		return DecodeStatus::Invalid;
+	std::memcpy(&flags, data, sizeof(flags));
+	std::memcpy(&count, data + sizeof(flags), sizeof(count));
+	count = GenericPacketHelper::ntoh(count);
+	data += sizeof(flags) + sizeof(count);
+	size -= sizeof(flags) + sizeof(count);
+	if (flags & ~(GenericPacketHelper::BundleCompressed | GenericPacketHelper::BundleChecksummed))
+		return DecodeStatus::Invalid;
+
+	if (flags & GenericPacketHelper::BundleChecksummed)
+	{
+		std::uint32_t checksum;
+		if (size < sizeof(checksum))
+			return DecodeStatus::Invalid;
+		std::memcpy(&checksum, data, sizeof(checksum));
+		data += sizeof(checksum);
+		size -= sizeof(checksum);
+		if (GenericPacketHelper::ntoh(checksum) != GenericPacketHelper::crc32(data, size))
+			return DecodeStatus::Invalid;
+	}
+
+	if (!(flags & GenericPacketHelper::BundleCompressed))
+		return unpackBody(data, size, count);
+
+	/* qCompress() prepends the uncompressed size, which is checked before
+	 * inflating anything: */
+	std::uint32_t uncompressedSize;
+	if (size < sizeof(uncompressedSize))
+		return DecodeStatus::Invalid;
+	std::memcpy(&uncompressedSize, data, sizeof(uncompressedSize));
+	if (GenericPacketHelper::ntoh(uncompressedSize) > m_maxUncompressedSize)
+		return DecodeStatus::Oversized;
+
+	QByteArray uncompressed = qUncompress(reinterpret_cast<const uchar *>(data),
+			static_cast<GenericPacketHelper::ByteArraySize>(size));
+	if (static_cast<std::uint32_t>(uncompressed.size()) != GenericPacketHelper::ntoh(uncompressedSize))
+		return DecodeStatus::Invalid;
+
+	m_data = std::move(uncompressed);
+	return unpackBody(m_data.constData(), static_cast<std::size_t>(m_data.size()), count);
+}
+
+template<typename S, typename T>
+typename PacketUnbundler<S, T>::DecodeStatus PacketUnbundler<S, T>::unpackBody(const char *data, std::size_t size,
+		std::uint32_t count)
+{
+	const std::size_t indexSize = static_cast<std::size_t>(count) * PacketBundler<S, T>::entrySize();
+	if (indexSize > size)
+		return DecodeStatus::Invalid;
+
+	const char *payload = data + indexSize;
+	std::size_t remaining = size - indexSize;
+	m_views.reserve(count);
+	for (std::uint32_t i = 0; i < count; ++i, data += PacketBundler<S, T>::entrySize())
+	{
+		T type;
+		S payloadSize;
+		std::memcpy(&type, data, sizeof(type));
+		std::memcpy(&payloadSize, data + sizeof(type), sizeof(payloadSize));
+		payloadSize = GenericPacketHelper::ntoh(payloadSize);
+		if (payloadSize > remaining)
+		{
+			m_views.clear();
+			return DecodeStatus::Invalid;
+		}
+
+		m_views.push_back(View{Header{typename Packet::Size{payloadSize}, Type{GenericPacketHelper::ntoh(type)}}, payload});
+		payload += payloadSize;
+		remaining -= payloadSize;
+	}
+
+	if (remaining)
+	{
+		m_views.clear();
+		return DecodeStatus::Invalid;
+	}
+	return DecodeStatus::Ok;
+}
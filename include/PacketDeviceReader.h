@@ -0,0 +1,169 @@
+#pragma once
+#include "GenericPacket.h"
+#include "PacketSizeLimits.h"
+#include <QIODevice>
+#include <QObject>
+#include <algorithm>
+#include <functional>
+
+/** \brief Reads packets from a QIODevice without intermediate buffers
+ *
+ * The header of each packet is read into a small fixed buffer, and its payload
+ * is then read straight into a QByteArray of exactly header.size() bytes,
+ * which the packet handler receives as the packet's payload. Nothing is
+ * appended to or removed from an accumulation buffer.
+ *
+ * Any QIODevice works (QTcpSocket, QLocalSocket, QSerialPort, QFile …).
+ * Available data is read on readyRead(). Devices that do not emit it, like
+ * QFile, are read by calling readAvailable().
+ *
+ * Packets over their type's limit in PacketSizeLimits are skipped: their
+ * payload is read in small pieces and dropped, without being stored.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketDeviceReader
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	using PacketHandler = std::function<void(Packet &&packet)>;
+	/** \brief Called once when reading stops because of a bad header */
+	using ErrorHandler = std::function<void(DecodeStatus status)>;
+	using Limits = PacketSizeLimits<S, T>;
+	using DiscardHandler = typename Limits::DiscardHandler;
+
+	/** \brief Read from \p device, which is not taken ownership of */
+	explicit PacketDeviceReader(QIODevice *device, PacketHandler handler = {});
+	~PacketDeviceReader() { QObject::disconnect(m_connection); }
+	PacketDeviceReader(const PacketDeviceReader &) = delete;
+	PacketDeviceReader &operator=(const PacketDeviceReader &) = delete;
+
+	void setPacketHandler(PacketHandler handler) { m_packetHandler = std::move(handler); }
+	void setErrorHandler(ErrorHandler handler) { m_errorHandler = std::move(handler); }
+	/** \brief Called when the header of a packet to be skipped is read */
+	void setDiscardHandler(DiscardHandler handler) { m_discardHandler = std::move(handler); }
+	/** \brief Stop reading on headers announcing payloads larger than this
+	 *
+	 * Payload buffers are allocated from the header, so this also bounds
+	 * what a peer can make the reader allocate.
+	 */
+	void setMaxPayloadSize(std::size_t size) { m_maxPayloadSize = size; }
+	/** \brief Skip packets over their type's limit */
+	void setSizeLimits(Limits limits) { m_limits = std::move(limits); }
+
+	QIODevice *device() const { return m_device; }
+	/** \brief DecodeStatus::Ok, or why reading stopped */
+	DecodeStatus status() const { return m_status; }
+	/** \brief Whether a packet has been partially read */
+	bool isReadingPacket() const { return m_headerRead != 0; }
+	/** \brief Number of packets skipped because of their size */
+	std::size_t discardedPackets() const { return m_discardedPackets; }
+
+	/** \brief Read what is available, handling every complete packet
+	 *
+	 * Returns the number of packets handled.
+	 */
+	int readAvailable();
+
+private:
+	QIODevice *m_device;
+	QMetaObject::Connection m_connection;
+	PacketHandler m_packetHandler;
+	ErrorHandler m_errorHandler;
+	DiscardHandler m_discardHandler;
+	std::size_t m_maxPayloadSize = Header::maxSize();
+	Limits m_limits;
+	DecodeStatus m_status = DecodeStatus::Ok;
+	std::size_t m_discardedPackets = 0;
+
+	char m_header[sizeof(GenericPacketHelper::RawHeader<S, T>)];
+	std::size_t m_headerRead = 0;
+	T m_type = T();
+	/* Sized from the header once it is complete: */
+	QByteArray m_payload;
+	std::size_t m_payloadSize = 0;
+	std::size_t m_payloadRead = 0;
+	bool m_discarding = false;
+};
+
+
+template<typename S, typename T>
+PacketDeviceReader<S, T>::PacketDeviceReader(QIODevice *device, PacketHandler handler)
+	: m_device(device),
+	m_packetHandler(std::move(handler))
+{
+	m_connection = QObject::connect(device, &QIODevice::readyRead, [this]() { readAvailable(); });
+}
+
+template<typename S, typename T>
+int PacketDeviceReader<S, T>::readAvailable()
+{
+	int count = 0;
+	while (m_status == DecodeStatus::Ok)
+	{
+		if (m_headerRead < Header::dataSize())
+		{
+			const qint64 read = m_device->read(m_header + m_headerRead,
+					static_cast<qint64>(Header::dataSize() - m_headerRead));
+			if (read <= 0)
+				break;
+			m_headerRead += static_cast<std::size_t>(read);
+			if (m_headerRead < Header::dataSize())
+				break;
+
+			const Header header = *Header::tryDecode(m_header, Header::dataSize());
+			if (header.size() > m_maxPayloadSize)
+			{
+				m_status = DecodeStatus::Oversized;
+				if (m_errorHandler)
+					m_errorHandler(m_status);
+				break;
+			}
+			m_type = header.type();
+			m_payloadSize = header.size();
+			m_payloadRead = 0;
+			m_discarding = !m_limits.allows(header);
+			if (m_discarding)
+			{
+				++m_discardedPackets;
+				if (m_discardHandler)
+					m_discardHandler(header);
+			}
+			else
+			{
+				m_payload.resize(static_cast<GenericPacketHelper::ByteArraySize>(m_payloadSize));
+			}
+		}
+
+		if (m_payloadRead < m_payloadSize)
+		{
+			/* Skipped payloads are read in pieces into a scratch buffer: */
+			char scratch[4096];
+			const qint64 read = m_discarding
+				? m_device->read(scratch, static_cast<qint64>(std::min(sizeof(scratch), m_payloadSize - m_payloadRead)))
+				: m_device->read(m_payload.data() + m_payloadRead, static_cast<qint64>(m_payloadSize - m_payloadRead));
+			if (read <= 0)
+				break;
+			m_payloadRead += static_cast<std::size_t>(read);
+			/* A skipped payload may need more reads into the scratch buffer: */
+			if (m_payloadRead < m_payloadSize && m_discarding)
+				continue;
+			if (m_payloadRead < m_payloadSize)
+				break;
+		}
+
+		m_headerRead = 0;
+		if (m_discarding)
+			continue;
+
+		/* Hand over the payload buffer, so the next packet gets a fresh one: */
+		Packet packet{Type{m_type}, std::move(m_payload)};
+		m_payload = QByteArray();
+		++count;
+		if (m_packetHandler)
+			m_packetHandler(std::move(packet));
+	}
+	return count;
+}
@@ -0,0 +1,291 @@
+#pragma once
+#include "GenericPacket.h"
+#include <algorithm>
+#include <deque>
+
+/** \brief Splits payloads too large for one frame into fragments
+ *
+ * Fragments are frames of a reserved marker type. Each fragment's payload
+ * starts with metadata (a message id, the real type, the total payload size
+ * and the fragment's offset, all in network byte order) followed by a piece of
+ * the payload. Payloads that fit in one frame are sent as plain packets. This
+ * keeps headers compact, e.g. with 16-bit sizes, while still allowing large
+ * payloads. As fragments are produced one at a time, other traffic can be
+ * sent between them. PacketReassembler puts the payloads back together.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketFragmenter
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+
+	/** \brief The frames of one payload, produced on demand */
+	class Fragments
+	{
+	public:
+		/** \brief A payload sent as one plain packet, without fragmenting */
+		static Fragments single(Type type, QByteArray payload)
+		{
+			return Fragments(T(), 0, type.value, std::move(payload), 0);
+		}
+
+		bool atEnd() const { return m_done; }
+		/** \brief Total number of frames */
+		std::size_t count() const;
+		/** \brief Produce the next frame. Must not be called at the end */
+		Packet next();
+
+	private:
+		friend class PacketFragmenter;
+		Fragments(T markerType, std::uint32_t id, T type, QByteArray payload, std::size_t pieceSize)
+			: m_markerType(markerType), m_id(id), m_type(type), m_payload(std::move(payload)), m_pieceSize(pieceSize) {}
+
+		T m_markerType;
+		std::uint32_t m_id;
+		T m_type;
+		QByteArray m_payload;
+		/* 0 for a payload sent as a plain packet: */
+		std::size_t m_pieceSize;
+		std::size_t m_offset = 0;
+		bool m_done = false;
+	};
+
+	/** \brief Fragment into frames of type \p markerType
+	 *
+	 * Frame payloads are at most \p maxFramePayload bytes, which must exceed
+	 * metadataSize() (a std::range_error is thrown otherwise).
+	 */
+	explicit PacketFragmenter(Type markerType, std::size_t maxFramePayload = Header::maxSize());
+
+	/** \brief Size of the metadata at the start of every fragment */
+	static std::size_t metadataSize() { return 2 * sizeof(std::uint64_t) + sizeof(std::uint32_t) + sizeof(T); }
+
+	/** \brief The frames to send for the given payload
+	 *
+	 * Payloads of the marker type are always fragmented, so that they are
+	 * not taken for fragments.
+	 */
+	Fragments fragment(Type type, QByteArray payload);
+
+private:
+	T m_markerType;
+	std::size_t m_maxFramePayload;
+	std::uint32_t m_nextId = 0;
+};
+
+/** \brief Reassembles payloads fragmented by PacketFragmenter
+ *
+ * The payload of a fragmented message is allocated in full when its first
+ * fragment arrives, and every fragment is copied straight into place.
+ * Fragments of a message must arrive in order, but fragments of several
+ * messages may be interleaved with each other and with plain packets.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketReassembler
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	using View = typename Packet::View;
+	using DecodeStatus = typename Packet::DecodeStatus;
+
+	struct Message
+	{
+		T type;
+		QByteArray payload;
+	};
+	using Result = typename Packet::template Result<Message>;
+
+	/** \brief Reassemble frames of type \p markerType
+	 *
+	 * Messages are at most \p maxMessageSize bytes. At most
+	 * \p maxPendingMessages are reassembled at a time, so up to their product
+	 * may be allocated. The oldest pending message is dropped to make room for
+	 * a new one.
+	 */
+	explicit PacketReassembler(Type markerType, std::size_t maxMessageSize = 64 * 1024 * 1024,
+			std::size_t maxPendingMessages = 16);
+
+	/** \brief Handle a received packet
+	 *
+	 * Plain packets are returned as messages right away, and so is the
+	 * payload a fragment completes. DecodeStatus::Incomplete is returned for
+	 * other fragments, DecodeStatus::Oversized for messages over the maximum
+	 * size, and DecodeStatus::Invalid for malformed or out of order fragments.
+	 * The message of a rejected fragment is dropped.
+	 */
+	Result add(const Packet &packet);
+	Result add(const View &packet);
+
+	std::size_t pendingMessages() const { return m_pending.size(); }
+	/** \brief Number of pending messages dropped to make room for new ones */
+	std::size_t droppedMessages() const { return m_dropped; }
+	void clear() { m_pending.clear(); }
+
+private:
+	struct Pending
+	{
+		std::uint32_t id;
+		T type;
+		QByteArray payload;
+		std::size_t received;
+	};
+
+	Result addFragment(const char *data, std::size_t size);
+
+	T m_markerType;
+	std::size_t m_maxMessageSize;
+	std::size_t m_maxPendingMessages;
+	std::deque<Pending> m_pending;
+	std::size_t m_dropped = 0;
+};
+
+
+template<typename S, typename T>
+std::size_t PacketFragmenter<S, T>::Fragments::count() const
+{
+	const std::size_t size = static_cast<std::size_t>(m_payload.size());
+	return m_pieceSize ? std::max<std::size_t>(1, (size + m_pieceSize - 1) / m_pieceSize) : 1;
+}
+
+template<typename S, typename T>
+typename PacketFragmenter<S, T>::Packet PacketFragmenter<S, T>::Fragments::next()
+{
+	if (!m_pieceSize)
+	{
+		m_done = true;
+		return Packet{Type{m_type}, m_payload};
+	}
+
+	const std::uint64_t total = static_cast<std::uint64_t>(m_payload.size());
+	const std::size_t piece = std::min<std::size_t>(m_pieceSize, static_cast<std::size_t>(total) - m_offset);
+	QByteArray frame;
+	frame.resize(static_cast<GenericPacketHelper::ByteArraySize>(metadataSize() + piece));
+
+	char *data = frame.data();
+	const auto networkId = GenericPacketHelper::hton(m_id);
+	const auto networkType = GenericPacketHelper::hton(m_type);
+	const auto networkTotal = GenericPacketHelper::hton(total);
+	const auto networkOffset = GenericPacketHelper::hton(static_cast<std::uint64_t>(m_offset));
+	std::memcpy(data, &networkId, sizeof(networkId));
+	data += sizeof(networkId);
+	std::memcpy(data, &networkType, sizeof(networkType));
+	data += sizeof(networkType);
+	std::memcpy(data, &networkTotal, sizeof(networkTotal));
+	data += sizeof(networkTotal);
+	std::memcpy(data, &networkOffset, sizeof(networkOffset));
+	data += sizeof(networkOffset);
+	std::memcpy(data, m_payload.constData() + m_offset, piece);
+
+	m_offset += piece;
+	m_done = m_offset == total;
+	return Packet{Type{m_markerType}, std::move(frame)};
+}
+
+template<typename S, typename T>
+PacketFragmenter<S, T>::PacketFragmenter(Type markerType, std::size_t maxFramePayload)
+	: m_markerType(markerType),
+	m_maxFramePayload(std::min(maxFramePayload, Header::maxSize()))
+{
+	if (m_maxFramePayload <= metadataSize())
+		GENERICPACKET_THROW(std::range_error("Frame payload size cannot hold fragment metadata"));
+}
+
+template<typename S, typename T>
+typename PacketFragmenter<S, T>::Fragments PacketFragmenter<S, T>::fragment(Type type, QByteArray payload)
+{
+	if (static_cast<std::size_t>(payload.size()) <= m_maxFramePayload && type.value != m_markerType)
+		return Fragments::single(type, std::move(payload));
+
+	return Fragments(m_markerType, m_nextId++, type.value, std::move(payload), m_maxFramePayload - metadataSize());
+}
+
+template<typename S, typename T>
+PacketReassembler<S, T>::PacketReassembler(Type markerType, std::size_t maxMessageSize,
+		std::size_t maxPendingMessages)
+	: m_markerType(markerType),
+	m_maxMessageSize(maxMessageSize),
+	m_maxPendingMessages(std::max<std::size_t>(1, maxPendingMessages))
+{
+}
+
+template<typename S, typename T>
+typename PacketReassembler<S, T>::Result PacketReassembler<S, T>::add(const Packet &packet)
+{
+	if (packet.header().type() != m_markerType)
+		return Message{packet.header().type(), packet.payload()};
+
+	return addFragment(packet.payload().constData(), static_cast<std::size_t>(packet.payload().size()));
+}
+
+template<typename S, typename T>
+typename PacketReassembler<S, T>::Result PacketReassembler<S, T>::add(const View &packet)
+{
+	if (packet.header.type() != m_markerType)
+		return Message{packet.header.type(), QByteArray(packet.payloadData,
+					static_cast<GenericPacketHelper::ByteArraySize>(packet.payloadSize()))};
+
+	return addFragment(packet.payloadData, packet.payloadSize());
+}
+
+template<typename S, typename T>
+typename PacketReassembler<S, T>::Result PacketReassembler<S, T>::addFragment(const char *data, std::size_t size)
+{
+	const std::size_t metadataSize = PacketFragmenter<S, T>::metadataSize();
+	if (size < metadataSize)
+		return DecodeStatus::Invalid;
+
+	std::uint32_t id;
+	T type;
+	std::uint64_t total;
+	std::uint64_t offset;
+	std::memcpy(&id, data, sizeof(id));
+	std::memcpy(&type, data + sizeof(id), sizeof(type));
+	std::memcpy(&total, data + sizeof(id) + sizeof(type), sizeof(total));
+	std::memcpy(&offset, data + sizeof(id) + sizeof(type) + sizeof(total), sizeof(offset));
+	id = GenericPacketHelper::ntoh(id);
+	type = GenericPacketHelper::ntoh(type);
+	total = GenericPacketHelper::ntoh(total);
+	offset = GenericPacketHelper::ntoh(offset);
+	data += metadataSize;
+	size -= metadataSize;
+
+	auto pending = std::find_if(m_pending.begin(), m_pending.end(),
+			[id](const Pending &message) { return message.id == id; });
+	if (pending == m_pending.end())
+	{
+		if (total > m_maxMessageSize)
+			return DecodeStatus::Oversized;
+		if (offset != 0)
+			return DecodeStatus::Invalid;
+
+		if (m_pending.size() == m_maxPendingMessages)
+		{
+			m_pending.pop_front();
+			++m_dropped;
+		}
+		m_pending.push_back(Pending{id, type, QByteArray(), 0});
+		pending = std::prev(m_pending.end());
+		pending->payload.resize(static_cast<GenericPacketHelper::ByteArraySize>(total));
+	}
+
+	/* Fragments must continue where the previous one ended: */
+	if (type != pending->type || total != static_cast<std::uint64_t>(pending->payload.size()) ||
+			offset != pending->received || size > total - offset)
+	{
+		m_pending.erase(pending);
+		return DecodeStatus::Invalid;
+	}
+
+	std::memcpy(pending->payload.data() + offset, data, size);
+	pending->received += size;
+	if (pending->received < total)
+		return DecodeStatus::Incomplete;
+
+	Message message{type, std::move(pending->payload)};
+	m_pending.erase(pending);
+	return message;
+}
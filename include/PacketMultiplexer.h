@@ -0,0 +1,377 @@
+#pragma once
+#include "GenericPacket.h"
+#include <QIODevice>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+
+/** \brief Carries many independent streams over one packet connection
+ *
+ * The most significant bits of every packet's type hold a stream id, and the
+ * remaining bits the type within the stream. Stream 0 is reserved for control
+ * frames, so streams 1 to maxStream() are available.
+ *
+ * Every stream has credit-based flow control. A stream may only send while it
+ * has credit left, which is initially the window size and is used up by the
+ * payload bytes sent. The receiver grants more credit with a control frame
+ * once half a window has been consumed by its application, i.e. taken out of
+ * the stream's queue or passed to the stream's handler. A slow stream thus
+ * buffers at most about a window (plus a packet) at the receiver, and never
+ * blocks the other streams. Streams with credit take turns in sending frames.
+ * The receiver enforces this: frames beyond a stream's window are rejected,
+ * and so are frames opening more streams than setMaxStreams() allows.
+ *
+ * Both peers must use the same number of stream bits and the same window.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketMultiplexer
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	using View = typename Packet::View;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	using StreamId = std::uint32_t;
+
+	struct Message
+	{
+		StreamId stream = 0;
+		/** \brief The type within the stream */
+		T type = 0;
+		QByteArray payload;
+	};
+	using MessageHandler = std::function<void(Message &&message)>;
+
+	/** \brief Use the top \p streamBits bits of the type for stream ids
+	 *
+	 * Throws a std::range_error unless 0 < \p streamBits < bits of T, and
+	 * \p streamBits is at most 32.
+	 */
+	explicit PacketMultiplexer(unsigned streamBits = std::numeric_limits<T>::digits / 2,
+			std::size_t window = 256 * 1024);
+
+	StreamId maxStream() const { return static_cast<StreamId>((std::uint64_t(1) << m_streamBits) - 1); }
+	/** \brief The packet type for \p type in \p stream
+	 *
+	 * Throws a std::range_error if either does not fit.
+	 */
+	Type composeType(StreamId stream, Type type) const;
+	StreamId streamOf(Type type) const { return static_cast<StreamId>(type.value >> m_typeBits); }
+	Type typeWithinStream(Type type) const { return Type{static_cast<T>(type.value & typeMask())}; }
+
+	/** \brief Queue a packet on \p stream (1 to maxStream()) */
+	void send(StreamId stream, Type type, QByteArray payload);
+	/** \brief Whether nextFrame() has anything to return */
+	bool hasFrames() const { return !m_control.empty() || !m_ready.empty(); }
+	/** \brief Take the next frame to send. Must only be called if hasFrames()
+	 *
+	 * Control frames go first, then the streams with credit take turns.
+	 */
+	Packet nextFrame();
+	/** \brief Write frames to \p device while it buffers less than \p maxBufferedBytes
+	 *
+	 * Call again on QIODevice::bytesWritten() and after receive(). Returns the
+	 * number of frames written completely. A frame the device fails to take in
+	 * full is kept, and its remaining bytes are written first on the next call.
+	 */
+	std::size_t writeTo(QIODevice *device, qint64 maxBufferedBytes = 16 * 1024);
+	/** \brief Whether writeTo() has part of a frame left to write */
+	bool hasUnwrittenFrame() const { return !m_unwritten.isEmpty(); }
+	/** \brief Payload bytes \p stream may still send (negative if overdrawn by its last packet) */
+	long long credit(StreamId stream) const;
+	/** \brief Number of packets waiting for credit on \p stream */
+	std::size_t queued(StreamId stream) const;
+
+	/** \brief The most streams known at a time (1024 by default)
+	 *
+	 * Frames of the peer that would open a stream beyond this are rejected.
+	 */
+	void setMaxStreams(std::size_t maxStreams) { m_maxStreams = maxStreams; }
+	/** \brief Pass the messages of \p stream to \p handler instead of queueing them */
+	void setMessageHandler(StreamId stream, MessageHandler handler);
+	/** \brief Demultiplex a received frame
+	 *
+	 * Returns DecodeStatus::Invalid for malformed control frames and for
+	 * frames that would open too many streams, and DecodeStatus::Oversized
+	 * for frames the peer sent without credit. Rejected frames are dropped.
+	 * Credit for streams that are not known (e.g. closed) is ignored.
+	 */
+	DecodeStatus receive(const Packet &frame);
+	DecodeStatus receive(const View &frame);
+	bool hasMessage(StreamId stream) const;
+	/** \brief Take the next message of \p stream. Must only be called if hasMessage() */
+	Message takeMessage(StreamId stream);
+
+	/** \brief Forget everything about \p stream, including queued packets */
+	void closeStream(StreamId stream);
+
+private:
+	enum ControlType : T
+	{
+		Credit,
+	};
+
+	struct Stream
+	{
+		/* Sending side: */
+		std::deque<std::pair<T, QByteArray>> output;
+		long long credit;
+		bool ready = false;
+		/* Receiving side: */
+		std::deque<Message> input;
+		std::size_t consumed = 0;
+		/* Bytes received that no credit was granted back for yet: */
+		std::size_t outstanding = 0;
+		MessageHandler handler;
+	};
+
+	T typeMask() const { return static_cast<T>((std::uint64_t(1) << m_typeBits) - 1); }
+	Stream &stream(StreamId id);
+	void makeReady(StreamId id, Stream &stream);
+	void consume(StreamId id, Stream &stream, std::size_t bytes);
+	DecodeStatus receive(Type type, const char *payload, std::size_t size, const QByteArray *shared);
+
+	unsigned m_streamBits;
+	unsigned m_typeBits;
+	std::size_t m_window;
+	std::size_t m_maxStreams = 1024;
+	std::unordered_map<StreamId, Stream> m_streams;
+	/* Streams with queued packets and credit, in turn: */
+	std::deque<StreamId> m_ready;
+	std::deque<Packet> m_control;
+	/* The rest of a frame the device did not take: */
+	QByteArray m_unwritten;
+};
+
+
+template<typename S, typename T>
+PacketMultiplexer<S, T>::PacketMultiplexer(unsigned streamBits, std::size_t window)
+	: m_streamBits(streamBits),
+	m_typeBits(std::numeric_limits<T>::digits - streamBits),
+	m_window(window)
+{
+	if (streamBits == 0 || streamBits >= static_cast<unsigned>(std::numeric_limits<T>::digits) || streamBits > 32)
+		GENERICPACKET_THROW(std::range_error("Invalid number of stream bits"));
+}
+
+template<typename S, typename T>
+typename PacketMultiplexer<S, T>::Type PacketMultiplexer<S, T>::composeType(StreamId stream, Type type) const
+{
+	if (stream > maxStream() || (type.value & ~typeMask()))
+		GENERICPACKET_THROW(std::range_error("Stream id or type does not fit in the packet type"));
+
+	return Type{static_cast<T>((static_cast<T>(stream) << m_typeBits) | type.value)};
+}
+
+template<typename S, typename T>
+void PacketMultiplexer<S, T>::send(StreamId id, Type type, QByteArray payload)
+{
+	if (id == 0)
+		GENERICPACKET_THROW(std::range_error("Stream 0 is reserved"));
+
+	const Type composed = composeType(id, type);
+	Stream &target = stream(id);
+	target.output.emplace_back(composed.value, std::move(payload));
+	makeReady(id, target);
+}
+
+template<typename S, typename T>
+typename PacketMultiplexer<S, T>::Packet PacketMultiplexer<S, T>::nextFrame()
+{
+	if (!m_control.empty())
+	{
+		Packet frame = std::move(m_control.front());
+		m_control.pop_front();
+		return frame;
+	}
+
+	const StreamId id = m_ready.front();
+	m_ready.pop_front();
+	Stream &sender = m_streams.at(id);
+	Packet frame{Type{sender.output.front().first}, std::move(sender.output.front().second)};
+	sender.output.pop_front();
+	sender.credit -= static_cast<long long>(frame.payload().size());
+	sender.ready = false;
+	makeReady(id, sender);
+	return frame;
+}
+
+template<typename S, typename T>
+std::size_t PacketMultiplexer<S, T>::writeTo(QIODevice *device, qint64 maxBufferedBytes)
+{
+	std::size_t written = 0;
+	while (device->bytesToWrite() < maxBufferedBytes)
+	{
+		if (m_unwritten.isEmpty())
+		{
+			if (!hasFrames())
+				break;
+			m_unwritten = nextFrame().toData();
+		}
+
+		const qint64 result = device->write(m_unwritten);
+		if (result < 0)
+			break;
+		m_unwritten.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(result));
+		if (!m_unwritten.isEmpty())
+			break;
+		++written;
+	}
+	return written;
+}
+
+template<typename S, typename T>
+long long PacketMultiplexer<S, T>::credit(StreamId id) const
+{
+	const auto found = m_streams.find(id);
+	return found == m_streams.end() ? static_cast<long long>(m_window) : found->second.credit;
+}
+
+template<typename S, typename T>
+std::size_t PacketMultiplexer<S, T>::queued(StreamId id) const
+{
+	const auto found = m_streams.find(id);
+	return found == m_streams.end() ? 0 : found->second.output.size();
+}
+
+template<typename S, typename T>
+void PacketMultiplexer<S, T>::setMessageHandler(StreamId id, MessageHandler handler)
+{
+	stream(id).handler = std::move(handler);
+}
+
+template<typename S, typename T>
+typename PacketMultiplexer<S, T>::DecodeStatus PacketMultiplexer<S, T>::receive(const Packet &frame)
+{
+	return receive(Type{frame.header().type()}, frame.payload().constData(),
+			static_cast<std::size_t>(frame.payload().size()), &frame.payload());
+}
+
+template<typename S, typename T>
+typename PacketMultiplexer<S, T>::DecodeStatus PacketMultiplexer<S, T>::receive(const View &frame)
+{
+	return receive(Type{frame.header.type()}, frame.payloadData, frame.payloadSize(), nullptr);
+}
+
+template<typename S, typename T>
+bool PacketMultiplexer<S, T>::hasMessage(StreamId id) const
+{
+	const auto found = m_streams.find(id);
+	return found != m_streams.end() && !found->second.input.empty();
+}
+
+template<typename S, typename T>
+typename PacketMultiplexer<S, T>::Message PacketMultiplexer<S, T>::takeMessage(StreamId id)
+{
+	Stream &receiver = m_streams.at(id);
+	Message message = std::move(receiver.input.front());
+	receiver.input.pop_front();
+	consume(id, receiver, static_cast<std::size_t>(message.payload.size()));
+	return message;
+}
+
+template<typename S, typename T>
+void PacketMultiplexer<S, T>::closeStream(StreamId id)
+{
+	m_streams.erase(id);
+	m_ready.erase(std::remove(m_ready.begin(), m_ready.end(), id), m_ready.end());
+}
+
+template<typename S, typename T>
+typename PacketMultiplexer<S, T>::Stream &PacketMultiplexer<S, T>::stream(StreamId id)
+{
+	const auto found = m_streams.find(id);
+	if (found != m_streams.end())
+		return found->second;
+
+	Stream &created = m_streams[id];
+	created.credit = static_cast<long long>(m_window);
+	return created;
+}
+
+template<typename S, typename T>
+void PacketMultiplexer<S, T>::makeReady(StreamId id, Stream &sender)
+{
+	/* A stream may overdraw its credit by its last packet, so that packets
+	 * larger than the window still get through: */
+	if (!sender.ready && !sender.output.empty() && sender.credit > 0)
+	{
+		sender.ready = true;
+		m_ready.push_back(id);
+	}
+}
+
+template<typename S, typename T>
+void PacketMultiplexer<S, T>::consume(StreamId id, Stream &receiver, std::size_t bytes)
+{
+	receiver.consumed += bytes;
+	if (receiver.consumed < m_window / 2)
+		return;
+
+	char grant[sizeof(std::uint32_t) + sizeof(std::uint64_t)];
+	const auto networkId = GenericPacketHelper::hton(static_cast<std::uint32_t>(id));
+	const auto networkCredit = GenericPacketHelper::hton(static_cast<std::uint64_t>(receiver.consumed));
+	std::memcpy(grant, &networkId, sizeof(networkId));
+	std::memcpy(grant + sizeof(networkId), &networkCredit, sizeof(networkCredit));
+	m_control.emplace_back(composeType(0, Type{Credit}), QByteArray(grant, sizeof(grant)));
+	receiver.outstanding -= std::min(receiver.outstanding, receiver.consumed);
+	receiver.consumed = 0;
+}
+
+template<typename S, typename T>
+typename PacketMultiplexer<S, T>::DecodeStatus PacketMultiplexer<S, T>::receive(Type type,
+		const char *payload, std::size_t size, const QByteArray *shared)
+{
+	const StreamId id = streamOf(type);
+	if (id == 0)
+	{
+		std::uint32_t target;
+		std::uint64_t credit;
+		if (typeWithinStream(type).value != Credit || size != sizeof(target) + sizeof(credit))
+			return DecodeStatus::Invalid;
+
+		std::memcpy(&target, payload, sizeof(target));
+		std::memcpy(&credit, payload + sizeof(target), sizeof(credit));
+		target = GenericPacketHelper::ntoh(target);
+		credit = GenericPacketHelper::ntoh(credit);
+		if (target == 0 || target > maxStream())
+			return DecodeStatus::Invalid;
+
+		const auto sender = m_streams.find(target);
+		if (sender == m_streams.end())
+			return DecodeStatus::Ok;
+		sender->second.credit += static_cast<long long>(credit);
+		makeReady(target, sender->second);
+		return DecodeStatus::Ok;
+	}
+
+	if (!m_streams.count(id) && m_streams.size() >= m_maxStreams)
+		return DecodeStatus::Invalid;
+	Stream &receiver = stream(id);
+	/* The peer may only send while it has credit, which it has while less
+	 * than a window is outstanding: */
+	if (receiver.outstanding >= m_window)
+		return DecodeStatus::Oversized;
+	receiver.outstanding += size;
+
+	Message message;
+	message.stream = id;
+	message.type = typeWithinStream(type).value;
+	message.payload = shared ? *shared : QByteArray(payload, static_cast<GenericPacketHelper::ByteArraySize>(size));
+
+	if (!receiver.handler)
+	{
+		receiver.input.push_back(std::move(message));
+		return DecodeStatus::Ok;
+	}
+
+	receiver.handler(std::move(message));
+	/* The handler may have closed the stream: */
+	const auto found = m_streams.find(id);
+	if (found != m_streams.end())
+		consume(id, found->second, size);
+	return DecodeStatus::Ok;
+}
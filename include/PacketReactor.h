@@ -0,0 +1,381 @@
+#pragma once
+#include "GenericPacket.h"
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/** \brief Single-threaded epoll loop serving many packet stream connections
+ *
+ * The reactor owns a set of non-blocking stream file descriptors. Each
+ * connection reads straight into its own decode buffer, sized from the
+ * header of the packet being received so that a whole packet fits, and every
+ * complete packet is passed to the packet handler as a GenericPacket::View
+ * into that buffer. Outgoing packets are written immediately when possible,
+ * and whatever the socket does not accept is queued and written once the
+ * socket becomes writable again.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketReactor
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Size = typename Packet::Size;
+	using Type = typename Packet::Type;
+	using View = typename Packet::View;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	/** \brief Called for every received packet. The view is only valid during the call */
+	using PacketHandler = std::function<void(int fd, const View &packet)>;
+	/** \brief Called when a connection is closed by the reactor
+	 *
+	 * \p error is 0 on end of file, and an errno value otherwise
+	 * (EMSGSIZE if a packet exceeded the maximum payload size).
+	 */
+	using CloseHandler = std::function<void(int fd, int error)>;
+
+	/** \brief Create the reactor. Check isValid() (and errno) for failure */
+	PacketReactor();
+	~PacketReactor();
+	PacketReactor(const PacketReactor &) = delete;
+	PacketReactor &operator=(const PacketReactor &) = delete;
+
+	bool isValid() const { return m_epoll >= 0; }
+
+	void setPacketHandler(PacketHandler handler) { m_packetHandler = std::move(handler); }
+	void setCloseHandler(CloseHandler handler) { m_closeHandler = std::move(handler); }
+	/** \brief Close connections announcing payloads larger than this */
+	void setMaxPayloadSize(std::size_t size) { m_maxPayloadSize = size; }
+
+	/** \brief Take ownership of \p fd, make it non-blocking and serve it
+	 *
+	 * Returns false (with errno set) on failure, in which case \p fd is
+	 * left untouched.
+	 */
+	bool add(int fd);
+	/** \brief Stop serving and close \p fd. The close handler is not called */
+	void remove(int fd);
+
+	/** \brief Send a packet on the given connection
+	 *
+	 * The packet is written right away if nothing is queued before it, and
+	 * anything not written is queued. Returns false if \p fd is unknown, or
+	 * if writing failed and the connection was closed.
+	 */
+	bool send(int fd, Type type, const char *payload, std::size_t size);
+	bool send(int fd, const Packet &packet);
+	/** \brief Number of bytes queued for writing on the given connection */
+	std::size_t queuedBytes(int fd) const;
+
+	/** \brief Wait for and handle events
+	 *
+	 * A negative timeout waits forever. Returns the number of events
+	 * handled, or -1 on error (errno is then set).
+	 */
+	int poll(int timeoutMs = -1);
+
+private:
+	struct Connection
+	{
+		/* Received bytes are input[begin, end): */
+		std::vector<char> input;
+		std::size_t begin = 0;
+		std::size_t end = 0;
+		/* Queued output, the first buffer written up to outputOffset: */
+		std::deque<QByteArray> output;
+		std::size_t outputOffset = 0;
+		std::size_t queuedBytes = 0;
+		bool writable = true;
+	};
+
+	void readFrom(int fd, Connection &connection);
+	bool writeQueued(int fd, Connection &connection);
+	void setWaitForWritable(int fd, Connection &connection, bool wait);
+	void close(int fd, int error);
+
+	static constexpr std::size_t readSize = 64 * 1024;
+	static constexpr int maxEvents = 256;
+
+	int m_epoll;
+	std::unordered_map<int, Connection> m_connections;
+	PacketHandler m_packetHandler;
+	CloseHandler m_closeHandler;
+	std::size_t m_maxPayloadSize = Header::maxSize();
+	/* A connection removed or closed by a handler while being read from is
+	 * only closed once reading is done. A close error of -1 means removed: */
+	int m_dispatchingFd = -1;
+	bool m_dispatchingRemoved = false;
+	int m_dispatchingError = -1;
+};
+
+
+template<typename S, typename T>
+PacketReactor<S, T>::PacketReactor()
+	: m_epoll(epoll_create1(EPOLL_CLOEXEC))
+{
+}
+
+template<typename S, typename T>
+PacketReactor<S, T>::~PacketReactor()
+{
+	for (const auto &connection : m_connections)
+		::close(connection.first);
+	if (m_epoll >= 0)
+		::close(m_epoll);
+}
+
+template<typename S, typename T>
+bool PacketReactor<S, T>::add(int fd)
+{
+	const int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return false;
+
+	epoll_event event{};
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.fd = fd;
+	if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+		return false;
+
+	m_connections[fd] = Connection{};
+	return true;
+}
+
+template<typename S, typename T>
+void PacketReactor<S, T>::remove(int fd)
+{
+	if (fd == m_dispatchingFd)
+	{
+		m_dispatchingRemoved = true;
+		return;
+	}
+	if (!m_connections.erase(fd))
+		return;
+
+	epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+	::close(fd);
+}
+
+template<typename S, typename T>
+bool PacketReactor<S, T>::send(int fd, Type type, const char *payload, std::size_t size)
+{
+	GenericPacketHelper::ensureSizeCanHoldPayload(Header::maxSize(), size);
+	const auto found = m_connections.find(fd);
+	if (found == m_connections.end())
+		return false;
+
+	Connection &connection = found->second;
+	char header[sizeof(GenericPacketHelper::RawHeader<S, T>)];
+	Header{Size{static_cast<S>(size)}, type}.toData(header);
+
+	std::size_t written = 0;
+	if (connection.output.empty())
+	{
+		/* Gather header and payload instead of concatenating them: */
+		iovec iov[2] = {
+			{ header, sizeof(header) },
+			{ const_cast<char *>(payload), size },
+		};
+		const ssize_t result = writev(fd, iov, 2);
+		if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			close(fd, errno);
+			return false;
+		}
+		written = result > 0 ? static_cast<std::size_t>(result) : 0;
+	}
+
+	/* Queue whatever was not written: */
+	QByteArray remainder;
+	if (written < sizeof(header))
+		remainder.append(header + written, static_cast<GenericPacketHelper::ByteArraySize>(sizeof(header) - written));
+	const std::size_t payloadWritten = written > sizeof(header) ? written - sizeof(header) : 0;
+	remainder.append(payload + payloadWritten, static_cast<GenericPacketHelper::ByteArraySize>(size - payloadWritten));
+	if (remainder.isEmpty())
+		return true;
+
+	connection.queuedBytes += static_cast<std::size_t>(remainder.size());
+	connection.output.push_back(std::move(remainder));
+	setWaitForWritable(fd, connection, true);
+	return true;
+}
+
+template<typename S, typename T>
+bool PacketReactor<S, T>::send(int fd, const Packet &packet)
+{
+	return send(fd, Type{packet.header().type()}, packet.payload().constData(),
+			static_cast<std::size_t>(packet.payload().size()));
+}
+
+template<typename S, typename T>
+std::size_t PacketReactor<S, T>::queuedBytes(int fd) const
+{
+	const auto found = m_connections.find(fd);
+	return found == m_connections.end() ? 0 : found->second.queuedBytes;
+}
+
+template<typename S, typename T>
+int PacketReactor<S, T>::poll(int timeoutMs)
+{
+	epoll_event events[maxEvents];
+	int count;
+	do
+		count = epoll_wait(m_epoll, events, maxEvents, timeoutMs);
+	while (count < 0 && errno == EINTR);
+
+	for (int i = 0; i < count; ++i)
+	{
+		const int fd = events[i].data.fd;
+		auto found = m_connections.find(fd);
+		if (found != m_connections.end() && (events[i].events & EPOLLOUT))
+		{
+			if (!writeQueued(fd, found->second))
+				continue;
+		}
+		/* Reading also picks up end of file and errors: */
+		found = m_connections.find(fd);
+		if (found != m_connections.end() && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+			readFrom(fd, found->second);
+	}
+	return count;
+}
+
+template<typename S, typename T>
+void PacketReactor<S, T>::readFrom(int fd, Connection &connection)
+{
+	/* Read at least the rest of the packet being received, if its header is
+	 * known, so that a large packet arrives with as few reads as possible: */
+	std::size_t wanted = readSize;
+	const auto header = Header::tryDecode(connection.input.data() + connection.begin,
+			connection.end - connection.begin);
+	if (header)
+		wanted = std::max(wanted, Header::dataSize() + header->size() - (connection.end - connection.begin));
+
+	if (connection.input.size() - connection.end < wanted)
+	{
+		/* Move the pending bytes to the front before growing the buffer: */
+		if (connection.begin)
+		{
+			std::memmove(connection.input.data(), connection.input.data() + connection.begin,
+					connection.end - connection.begin);
+			connection.end -= connection.begin;
+			connection.begin = 0;
+		}
+		if (connection.input.size() - connection.end < wanted)
+			connection.input.resize(connection.end + wanted);
+	}
+
+	const ssize_t received = read(fd, connection.input.data() + connection.end,
+			connection.input.size() - connection.end);
+	if (received <= 0)
+	{
+		if (received == 0)
+			close(fd, 0);
+		else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			close(fd, errno);
+		return;
+	}
+	connection.end += static_cast<std::size_t>(received);
+
+	m_dispatchingFd = fd;
+	auto packet = Packet::tryDecodeView(connection.input.data() + connection.begin,
+			connection.end - connection.begin, m_maxPayloadSize);
+	while (packet && !m_dispatchingRemoved)
+	{
+		connection.begin += Header::dataSize() + packet->payloadSize();
+		if (m_packetHandler)
+			m_packetHandler(fd, *packet);
+		packet = Packet::tryDecodeView(connection.input.data() + connection.begin,
+				connection.end - connection.begin, m_maxPayloadSize);
+	}
+	m_dispatchingFd = -1;
+
+	if (m_dispatchingRemoved)
+	{
+		const int error = m_dispatchingError;
+		m_dispatchingRemoved = false;
+		m_dispatchingError = -1;
+		if (error < 0)
+			remove(fd);
+		else
+			close(fd, error);
+		return;
+	}
+	if (packet.status() == DecodeStatus::Oversized)
+	{
+		close(fd, EMSGSIZE);
+		return;
+	}
+	if (connection.begin == connection.end)
+		connection.begin = connection.end = 0;
+}
+
+template<typename S, typename T>
+bool PacketReactor<S, T>::writeQueued(int fd, Connection &connection)
+{
+	while (!connection.output.empty())
+	{
+		iovec iov[64];
+		int count = 0;
+		for (auto buffer = connection.output.begin(); buffer != connection.output.end() && count < 64; ++buffer, ++count)
+			iov[count] = { buffer->data(), static_cast<std::size_t>(buffer->size()) };
+		iov[0].iov_base = static_cast<char *>(iov[0].iov_base) + connection.outputOffset;
+		iov[0].iov_len -= connection.outputOffset;
+
+		const ssize_t result = writev(fd, iov, count);
+		if (result < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return true;
+			close(fd, errno);
+			return false;
+		}
+
+		auto written = static_cast<std::size_t>(result);
+		connection.queuedBytes -= written;
+		while (written && written >= static_cast<std::size_t>(connection.output.front().size()) - connection.outputOffset)
+		{
+			written -= static_cast<std::size_t>(connection.output.front().size()) - connection.outputOffset;
+			connection.output.pop_front();
+			connection.outputOffset = 0;
+		}
+		connection.outputOffset += written;
+	}
+
+	setWaitForWritable(fd, connection, false);
+	return true;
+}
+
+template<typename S, typename T>
+void PacketReactor<S, T>::setWaitForWritable(int fd, Connection &connection, bool wait)
+{
+	/* The connection is writable when not waiting for EPOLLOUT: */
+	if (connection.writable != wait)
+		return;
+
+	epoll_event event{};
+	event.events = EPOLLIN | EPOLLRDHUP | (wait ? EPOLLOUT : 0u);
+	event.data.fd = fd;
+	epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &event);
+	connection.writable = !wait;
+}
+
+template<typename S, typename T>
+void PacketReactor<S, T>::close(int fd, int error)
+{
+	if (fd == m_dispatchingFd)
+	{
+		m_dispatchingRemoved = true;
+		m_dispatchingError = error;
+		return;
+	}
+	remove(fd);
+	if (m_closeHandler)
+		m_closeHandler(fd, error);
+}
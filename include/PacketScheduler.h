@@ -0,0 +1,192 @@
+#pragma once
+#include "PacketFragmenter.h"
+#include <QIODevice>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/** \brief Outbound queue that orders frames by priority
+ *
+ * Packets are queued at a priority level, 0 being the most urgent, either
+ * explicitly or by a per-type mapping. Frames are taken from the levels in
+ * strict priority order, or in weighted round robin where each level may send
+ * as many frames in a row as its weight.
+ *
+ * A frame that has started to be written still delays everything behind it.
+ * With fragmentation enabled, large payloads are split into fragments (see
+ * PacketFragmenter) that are scheduled one at a time, which bounds this delay
+ * to a single fragment. writeTo() only keeps a few bytes buffered in the
+ * device, so that urgent packets can overtake queued ones.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketScheduler
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	using Fragmenter = PacketFragmenter<S, T>;
+
+	enum class Policy
+	{
+		/* Always send from the most urgent level that has frames: */
+		StrictPriority,
+		/* Let every level send as many frames in a row as its weight: */
+		WeightedRoundRobin,
+	};
+
+	explicit PacketScheduler(std::size_t levels = 4, Policy policy = Policy::StrictPriority);
+
+	/** \brief Queue packets of \p type at \p level by default */
+	void setPriority(Type type, std::size_t level) { m_priorities[type.value] = std::min(level, m_queues.size() - 1); }
+	/** \brief The level of types without a priority of their own (the least urgent by default) */
+	void setDefaultPriority(std::size_t level) { m_defaultPriority = std::min(level, m_queues.size() - 1); }
+	/** \brief Frames sent in a row from \p level with Policy::WeightedRoundRobin (at least 1) */
+	void setWeight(std::size_t level, unsigned weight) { m_weights.at(level) = std::max(1u, weight); }
+	/** \brief Fragment payloads larger than \p maxFramePayload into frames of type \p markerType */
+	void enableFragmentation(Type markerType, std::size_t maxFramePayload);
+
+	std::size_t priority(Type type) const;
+
+	/** \brief Queue a packet
+	 *
+	 * Without fragmentation, a std::range_error is thrown if the size type
+	 * cannot hold the payload size.
+	 */
+	void enqueue(Type type, QByteArray payload) { enqueue(type, std::move(payload), priority(type)); }
+	void enqueue(Type type, QByteArray payload, std::size_t level);
+	void enqueue(const Packet &packet) { enqueue(Type{packet.header().type()}, packet.payload()); }
+
+	bool isEmpty() const { return m_queued == 0; }
+	/** \brief Number of queued packets, counting partly sent ones */
+	std::size_t queued() const { return m_queued; }
+	std::size_t queued(std::size_t level) const { return m_queues.at(level).size(); }
+
+	/** \brief Take the next frame to send. Must not be called when empty */
+	Packet next();
+	/** \brief Write frames to \p device while it buffers less than \p maxBufferedBytes
+	 *
+	 * Call again on QIODevice::bytesWritten(). Returns the number of frames
+	 * written completely. A frame the device fails to take in full is kept,
+	 * and its remaining bytes are written first on the next call, so that no
+	 * fragment goes missing.
+	 */
+	std::size_t writeTo(QIODevice *device, qint64 maxBufferedBytes = 16 * 1024);
+	/** \brief Whether writeTo() has part of a frame left to write */
+	bool hasUnwrittenFrame() const { return !m_unwritten.isEmpty(); }
+
+private:
+	using Fragments = typename Fragmenter::Fragments;
+
+	std::size_t nextLevel();
+
+	std::vector<std::deque<Fragments>> m_queues;
+	Policy m_policy;
+	std::unordered_map<T, std::size_t> m_priorities;
+	std::size_t m_defaultPriority;
+	std::vector<unsigned> m_weights;
+	std::unique_ptr<Fragmenter> m_fragmenter;
+	std::size_t m_queued = 0;
+	/* Round robin state, starting over at level 0: */
+	std::size_t m_current;
+	unsigned m_credit = 0;
+	/* The rest of a frame the device did not take: */
+	QByteArray m_unwritten;
+};
+
+
+template<typename S, typename T>
+PacketScheduler<S, T>::PacketScheduler(std::size_t levels, Policy policy)
+	: m_queues(std::max<std::size_t>(1, levels)),
+	m_policy(policy),
+	m_defaultPriority(m_queues.size() - 1),
+	m_weights(m_queues.size(), 1),
+	m_current(m_queues.size() - 1)
+{
+}
+
+template<typename S, typename T>
+void PacketScheduler<S, T>::enableFragmentation(Type markerType, std::size_t maxFramePayload)
+{
+	m_fragmenter.reset(new Fragmenter(markerType, maxFramePayload));
+}
+
+template<typename S, typename T>
+std::size_t PacketScheduler<S, T>::priority(Type type) const
+{
+	const auto found = m_priorities.find(type.value);
+	return found == m_priorities.end() ? m_defaultPriority : found->second;
+}
+
+template<typename S, typename T>
+void PacketScheduler<S, T>::enqueue(Type type, QByteArray payload, std::size_t level)
+{
+	/* Without fragmentation, a payload the size type cannot hold would only
+	 * throw in next(), and block the queue for good: */
+	if (!m_fragmenter)
+		GenericPacketHelper::ensureSizeCanHoldPayload(Header::maxSize(), static_cast<std::size_t>(payload.size()));
+
+	m_queues.at(level).push_back(m_fragmenter ? m_fragmenter->fragment(type, std::move(payload))
+			: Fragments::single(type, std::move(payload)));
+	++m_queued;
+}
+
+template<typename S, typename T>
+typename PacketScheduler<S, T>::Packet PacketScheduler<S, T>::next()
+{
+	auto &queue = m_queues[nextLevel()];
+	Packet frame = queue.front().next();
+	if (queue.front().atEnd())
+	{
+		queue.pop_front();
+		--m_queued;
+	}
+	return frame;
+}
+
+template<typename S, typename T>
+std::size_t PacketScheduler<S, T>::writeTo(QIODevice *device, qint64 maxBufferedBytes)
+{
+	std::size_t written = 0;
+	while (device->bytesToWrite() < maxBufferedBytes)
+	{
+		if (m_unwritten.isEmpty())
+		{
+			if (isEmpty())
+				break;
+			m_unwritten = next().toData();
+		}
+
+		const qint64 result = device->write(m_unwritten);
+		if (result < 0)
+			break;
+		m_unwritten.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(result));
+		if (!m_unwritten.isEmpty())
+			break;
+		++written;
+	}
+	return written;
+}
+
+template<typename S, typename T>
+std::size_t PacketScheduler<S, T>::nextLevel()
+{
+	if (m_policy == Policy::StrictPriority)
+	{
+		std::size_t level = 0;
+		while (m_queues[level].empty())
+			++level;
+		return level;
+	}
+
+	/* Stay on the current level while it has frames and credit: */
+	while (m_queues[m_current].empty() || !m_credit)
+	{
+		m_current = (m_current + 1) % m_queues.size();
+		m_credit = m_weights[m_current];
+	}
+	--m_credit;
+	return m_current;
+}
@@ -0,0 +1,228 @@
+#pragma once
+#include "GenericPacket.h"
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+
+/** \brief Whether sequence numbers count all packets or each type separately */
+enum class PacketSequenceScope
+{
+	PerConnection,
+	PerType,
+};
+
+/** \brief Stamps consecutive sequence numbers into an extra header field
+ *
+ * \p Packet is a GenericPacket with extra fields (see GenericPacket), and
+ * \p Field the index of the extra field holding the sequence number, which
+ * wraps around.
+ */
+template<typename Packet, std::size_t Field = 0>
+class PacketSequencer
+{
+public:
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	using Sequence = typename Header::template ExtraField<Field>;
+
+	explicit PacketSequencer(PacketSequenceScope scope = PacketSequenceScope::PerConnection) : m_scope(scope) {}
+
+	/** \brief Take the next sequence number for packets of \p type */
+	Sequence next(Type type);
+	/** \brief Stamp the next sequence number into \p header */
+	void stamp(Header &header) { header.template setExtra<Field>(next(Type{header.type()})); }
+	void stamp(Packet &packet) { stamp(packet.header()); }
+
+private:
+	PacketSequenceScope m_scope;
+	Sequence m_next = 0;
+	std::unordered_map<decltype(std::declval<Header>().type()), Sequence> m_nextPerType;
+};
+
+/** \brief Detects lost, duplicated and reordered packets by their sequence numbers
+ *
+ * For every sequence (the connection or each type, see PacketSequenceScope),
+ * only the highest sequence number seen and a bitmap of which of the 64 before
+ * it arrived are kept, along with a bitmap of which of them are missing. A
+ * jump ahead counts the skipped numbers as missing, and a late arrival within
+ * the bitmap is either a reorder, which makes it no longer missing if it was
+ * skipped by a gap, or a duplicate. Packets older than the bitmap are
+ * counted as too old to tell. Sequence numbers are compared in serial number
+ * arithmetic, so wrapping around is handled.
+ */
+template<typename Packet, std::size_t Field = 0>
+class PacketSequenceTracker
+{
+public:
+	using Header = typename Packet::Header;
+	using Sequence = typename Header::template ExtraField<Field>;
+	static_assert(std::is_unsigned<Sequence>::value, "Sequence numbers must be unsigned");
+
+	enum class Event
+	{
+		/* The next expected packet, or the first one: */
+		InOrder,
+		/* Ahead of the next expected packet, with the packets between missing: */
+		Gap,
+		/* A packet arriving late, e.g. a missing one: */
+		Reordered,
+		Duplicate,
+		/* Older than the tracked window, so neither of the above can be told: */
+		TooOld,
+	};
+
+	/** \brief Called with the missing range [\p first, \p last] when a gap is detected */
+	using GapHandler = std::function<void(const Header &header, Sequence first, Sequence last)>;
+	/** \brief Called for duplicates, reorders and packets too old to tell */
+	using EventHandler = std::function<void(const Header &header, Event event)>;
+
+	explicit PacketSequenceTracker(PacketSequenceScope scope = PacketSequenceScope::PerConnection) : m_scope(scope) {}
+
+	void setGapHandler(GapHandler handler) { m_gapHandler = std::move(handler); }
+	void setEventHandler(EventHandler handler) { m_eventHandler = std::move(handler); }
+
+	/** \brief Account for the received packet with \p header */
+	Event track(const Header &header);
+	Event track(const Packet &packet) { return track(packet.header()); }
+
+	/** \brief Number of packets tracked */
+	std::size_t packets() const { return m_packets; }
+	/** \brief Number of gaps detected */
+	std::size_t gaps() const { return m_gaps; }
+	/** \brief Number of packets skipped by gaps that have not arrived late */
+	std::size_t missing() const;
+	std::size_t reordered() const { return m_reordered; }
+	std::size_t duplicates() const { return m_duplicates; }
+	std::size_t tooOld() const { return m_tooOld; }
+
+	/** \brief Forget all sequences and reset the counters */
+	void reset();
+
+private:
+	struct State
+	{
+		bool started = false;
+		Sequence highest = 0;
+		/* Bit n is set if highest - n has arrived: */
+		std::uint64_t received = 0;
+		/* Bit n is set if highest - n was skipped by a gap and has not arrived: */
+		std::uint64_t gapped = 0;
+		std::size_t missing = 0;
+	};
+
+	State &state(const Header &header);
+	Event notify(const Header &header, Event event);
+
+	PacketSequenceScope m_scope;
+	State m_state;
+	std::unordered_map<decltype(std::declval<Header>().type()), State> m_statePerType;
+	GapHandler m_gapHandler;
+	EventHandler m_eventHandler;
+	std::size_t m_packets = 0;
+	std::size_t m_gaps = 0;
+	std::size_t m_reordered = 0;
+	std::size_t m_duplicates = 0;
+	std::size_t m_tooOld = 0;
+};
+
+
+template<typename Packet, std::size_t Field>
+typename PacketSequencer<Packet, Field>::Sequence PacketSequencer<Packet, Field>::next(Type type)
+{
+	Sequence &next = m_scope == PacketSequenceScope::PerType ? m_nextPerType[type.value] : m_next;
+	return next++;
+}
+
+template<typename Packet, std::size_t Field>
+typename PacketSequenceTracker<Packet, Field>::Event PacketSequenceTracker<Packet, Field>::track(const Header &header)
+{
+	using Distance = typename std::make_signed<Sequence>::type;
+	const unsigned window = 64;
+
+	++m_packets;
+	State &current = state(header);
+	const Sequence sequence = header.template extra<Field>();
+	if (!current.started)
+	{
+		current.started = true;
+		current.highest = sequence;
+		current.received = 1;
+		return Event::InOrder;
+	}
+
+	/* Serial number arithmetic: the difference modulo 2^n, taken as signed: */
+	const Distance distance = static_cast<Distance>(static_cast<Sequence>(sequence - current.highest));
+	if (distance > 0)
+	{
+		const Sequence skipped = static_cast<Sequence>(distance - 1);
+		const bool inWindow = static_cast<std::uint64_t>(distance) < window;
+		current.received = inWindow ? current.received << distance | 1 : 1;
+		current.gapped = inWindow ? current.gapped << distance : 0;
+		current.highest = sequence;
+		if (!skipped)
+			return Event::InOrder;
+
+		/* Bits 1 to skipped, as far as they are within the window: */
+		current.gapped |= skipped < window - 1 ? (std::uint64_t(1) << (skipped + 1)) - 2 : ~std::uint64_t(1);
+		current.missing += skipped;
+		++m_gaps;
+		if (m_gapHandler)
+			m_gapHandler(header, static_cast<Sequence>(sequence - skipped), static_cast<Sequence>(sequence - 1));
+		return Event::Gap;
+	}
+
+	/* Negating the most negative distance would overflow, but it is too old anyway: */
+	if (distance == std::numeric_limits<Distance>::min() || -distance >= static_cast<Distance>(window))
+	{
+		++m_tooOld;
+		return notify(header, Event::TooOld);
+	}
+
+	const std::uint64_t bit = std::uint64_t(1) << -distance;
+	if (current.received & bit)
+	{
+		++m_duplicates;
+		return notify(header, Event::Duplicate);
+	}
+
+	/* Packets before the first one tracked were never counted as missing: */
+	current.received |= bit;
+	if (current.gapped & bit)
+	{
+		current.gapped &= ~bit;
+		--current.missing;
+	}
+	++m_reordered;
+	return notify(header, Event::Reordered);
+}
+
+template<typename Packet, std::size_t Field>
+void PacketSequenceTracker<Packet, Field>::reset()
+{
+	m_state = State();
+	m_statePerType.clear();
+	m_packets = m_gaps = m_reordered = m_duplicates = m_tooOld = 0;
+}
+
+template<typename Packet, std::size_t Field>
+std::size_t PacketSequenceTracker<Packet, Field>::missing() const
+{
+	std::size_t missing = m_state.missing;
+	for (const auto &state : m_statePerType)
+		missing += state.second.missing;
+	return missing;
+}
+
+template<typename Packet, std::size_t Field>
+typename PacketSequenceTracker<Packet, Field>::State &PacketSequenceTracker<Packet, Field>::state(const Header &header)
+{
+	return m_scope == PacketSequenceScope::PerType ? m_statePerType[header.type()] : m_state;
+}
+
+template<typename Packet, std::size_t Field>
+typename PacketSequenceTracker<Packet, Field>::Event PacketSequenceTracker<Packet, Field>::notify(const Header &header, Event event)
+{
+	if (m_eventHandler)
+		m_eventHandler(header, event);
+	return event;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "GenericPacket.h"
+#include <functional>
+#include <unordered_map>
+
+/** \brief Maximum payload sizes per packet type
+ *
+ * Checked by the streaming decoders as soon as a header is parsed. Packets
+ * over their type's limit are skipped without being stored, instead of
+ * stopping decoding or closing the connection. Types without a limit of their
+ * own use the default limit.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketSizeLimits
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	/** \brief Called with the header of every packet skipped because of its size */
+	using DiscardHandler = std::function<void(const Header &header)>;
+
+	PacketSizeLimits &setLimit(Type type, std::size_t maxPayloadSize)
+	{
+		m_limits[type.value] = maxPayloadSize;
+		return *this;
+	}
+	PacketSizeLimits &removeLimit(Type type)
+	{
+		m_limits.erase(type.value);
+		return *this;
+	}
+	/** \brief The limit of types without a limit of their own */
+	PacketSizeLimits &setDefaultLimit(std::size_t maxPayloadSize)
+	{
+		m_defaultLimit = maxPayloadSize;
+		return *this;
+	}
+
+	std::size_t limit(Type type) const
+	{
+		const auto found = m_limits.find(type.value);
+		return found == m_limits.end() ? m_defaultLimit : found->second;
+	}
+	/** \brief Whether the packet of \p header is within its type's limit */
+	bool allows(const Header &header) const { return header.size() <= limit(Type{header.type()}); }
+
+private:
+	std::unordered_map<T, std::size_t> m_limits;
+	std::size_t m_defaultLimit = Header::maxSize();
+};
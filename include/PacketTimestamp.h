@@ -0,0 +1,235 @@
+#pragma once
+#include "GenericPacket.h"
+#include <algorithm>
+#include <time.h>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+/** \brief Clock of send timestamps
+ *
+ * CLOCK_MONOTONIC timestamps are only comparable on the same host (e.g. over
+ * shared memory or a Unix domain socket). Across hosts, CLOCK_REALTIME has to
+ * be used, and one-way latencies are then only as exact as the clocks are
+ * synchronised.
+ */
+enum class PacketClock
+{
+	Monotonic,
+	Realtime,
+};
+
+namespace GenericPacketHelper
+{
+	/* Current time of the clock in nanoseconds: */
+	inline std::uint64_t now(PacketClock clock)
+	{
+		timespec time;
+		clock_gettime(clock == PacketClock::Monotonic ? CLOCK_MONOTONIC : CLOCK_REALTIME, &time);
+		return static_cast<std::uint64_t>(time.tv_sec) * 1000000000u + static_cast<std::uint64_t>(time.tv_nsec);
+	}
+}
+
+/** \brief Stamps the send time into a 64-bit extra header field
+ *
+ * \p Packet is a GenericPacket with extra fields (see GenericPacket), and
+ * \p Field the index of the std::uint64_t extra field holding the time in
+ * nanoseconds.
+ */
+template<typename Packet, std::size_t Field = 0>
+class PacketTimestamper
+{
+public:
+	using Header = typename Packet::Header;
+	static_assert(std::is_same<typename Header::template ExtraField<Field>, std::uint64_t>::value,
+			"Timestamps must be std::uint64_t");
+
+	explicit PacketTimestamper(PacketClock clock = PacketClock::Realtime) : m_clock(clock) {}
+
+	void stamp(Header &header) const { header.template setExtra<Field>(GenericPacketHelper::now(m_clock)); }
+	void stamp(Packet &packet) const { stamp(packet.header()); }
+	/** \brief Stamp \p packet and serialize it right away */
+	QByteArray toData(Packet &packet) const
+	{
+		stamp(packet);
+		return packet.toData();
+	}
+
+private:
+	PacketClock m_clock;
+};
+
+/** \brief Histogram of nanosecond durations with about 3% precision
+ *
+ * Values are counted in buckets of 32 per power of two (and exactly below 64),
+ * so recording is O(1) and the memory use is fixed at about 15 KiB no matter
+ * how many values are recorded. Percentiles are reported as the upper bound of
+ * their bucket.
+ */
+class LatencyHistogram
+{
+public:
+	LatencyHistogram() : m_buckets(bucketCount, 0) {}
+
+	void record(std::uint64_t nanoseconds);
+
+	std::uint64_t count() const { return m_count; }
+	std::uint64_t min() const { return m_count ? m_min : 0; }
+	std::uint64_t max() const { return m_max; }
+	std::uint64_t mean() const { return m_count ? static_cast<std::uint64_t>(m_sum / m_count) : 0; }
+	/** \brief The value below which \p percent of the recorded values are (0 if none) */
+	std::uint64_t percentile(double percent) const;
+
+	void reset();
+
+private:
+	static const unsigned subBucketBits = 5;
+	static const std::size_t subBuckets = std::size_t(1) << subBucketBits;
+	static const std::size_t bucketCount = (64 - subBucketBits + 1) * subBuckets;
+
+	static std::size_t bucket(std::uint64_t value);
+	static std::uint64_t upperBound(std::size_t bucket);
+
+	std::vector<std::uint64_t> m_buckets;
+	std::uint64_t m_count = 0;
+	std::uint64_t m_min = std::numeric_limits<std::uint64_t>::max();
+	std::uint64_t m_max = 0;
+	long double m_sum = 0;
+};
+
+/** \brief Measures one-way latencies of packets stamped by PacketTimestamper
+ *
+ * Latencies are recorded for all packets together, and separately for the
+ * types registered with trackType(). Types are not tracked on their own by
+ * default, so a peer sending many types cannot make the tracker allocate a
+ * histogram for each. Packets stamped later than they are received, due to
+ * clock differences, count as having no latency.
+ */
+template<typename Packet, std::size_t Field = 0>
+class PacketLatencyTracker
+{
+public:
+	using Header = typename Packet::Header;
+	using Type = typename Packet::Type;
+	static_assert(std::is_same<typename Header::template ExtraField<Field>, std::uint64_t>::value,
+			"Timestamps must be std::uint64_t");
+
+	/** \brief Use the same clock as the sender's PacketTimestamper */
+	explicit PacketLatencyTracker(PacketClock clock = PacketClock::Realtime) : m_clock(clock) {}
+
+	/** \brief Record the latency of a packet received now, and return it */
+	std::uint64_t record(const Header &header) { return record(header, GenericPacketHelper::now(m_clock)); }
+	std::uint64_t record(const Packet &packet) { return record(packet.header()); }
+	/** \brief Record the latency of a packet received at \p receivedAt */
+	std::uint64_t record(const Header &header, std::uint64_t receivedAt);
+
+	/** \brief Also record the latencies of \p type in a histogram of its own */
+	PacketLatencyTracker &trackType(Type type)
+	{
+		m_perType[type.value];
+		return *this;
+	}
+	PacketLatencyTracker &untrackType(Type type)
+	{
+		m_perType.erase(type.value);
+		return *this;
+	}
+	bool isTracked(Type type) const { return m_perType.count(type.value) != 0; }
+
+	/** \brief Latencies of all packets */
+	const LatencyHistogram &histogram() const { return m_all; }
+	/** \brief Latencies of the packets of \p type (empty unless it is tracked) */
+	const LatencyHistogram &histogram(Type type) const;
+
+	/** \brief Clear all histograms, keeping the tracked types */
+	void reset();
+
+private:
+	PacketClock m_clock;
+	LatencyHistogram m_all;
+	std::unordered_map<decltype(std::declval<Header>().type()), LatencyHistogram> m_perType;
+};
+
+
+inline void LatencyHistogram::record(std::uint64_t nanoseconds)
+{
+	++m_buckets[bucket(nanoseconds)];
+	++m_count;
+	m_min = std::min(m_min, nanoseconds);
+	m_max = std::max(m_max, nanoseconds);
+	m_sum += nanoseconds;
+}
+
+inline std::uint64_t LatencyHistogram::percentile(double percent) const
+{
+	if (!m_count)
+		return 0;
+
+	const double rank = std::max(1.0, std::min(percent, 100.0) / 100 * static_cast<double>(m_count));
+	std::uint64_t seen = 0;
+	for (std::size_t index = 0; index < m_buckets.size(); ++index)
+	{
+		seen += m_buckets[index];
+		if (static_cast<double>(seen) >= rank)
+			return std::min(upperBound(index), m_max);
+	}
+	return m_max;
+}
+
+inline void LatencyHistogram::reset()
+{
+	std::fill(m_buckets.begin(), m_buckets.end(), 0);
+	m_count = 0;
+	m_min = std::numeric_limits<std::uint64_t>::max();
+	m_max = 0;
+	m_sum = 0;
+}
+
+inline std::size_t LatencyHistogram::bucket(std::uint64_t value)
+{
+	if (value < 2 * subBuckets)
+		return static_cast<std::size_t>(value);
+
+	/* The group by the highest bit set, and the next subBucketBits bits: */
+	const unsigned highestBit = 63 - static_cast<unsigned>(__builtin_clzll(value));
+	const unsigned shift = highestBit - subBucketBits;
+	return (shift + 1) * subBuckets + static_cast<std::size_t>((value >> shift) - subBuckets);
+}
+
+inline std::uint64_t LatencyHistogram::upperBound(std::size_t bucket)
+{
+	if (bucket < 2 * subBuckets)
+		return bucket;
+
+	const unsigned shift = static_cast<unsigned>(bucket / subBuckets - 1);
+	const std::uint64_t lower = static_cast<std::uint64_t>(subBuckets + bucket % subBuckets) << shift;
+	return lower + ((std::uint64_t(1) << shift) - 1);
+}
+
+template<typename Packet, std::size_t Field>
+std::uint64_t PacketLatencyTracker<Packet, Field>::record(const Header &header, std::uint64_t receivedAt)
+{
+	const std::uint64_t sentAt = header.template extra<Field>();
+	const std::uint64_t latency = receivedAt > sentAt ? receivedAt - sentAt : 0;
+	m_all.record(latency);
+	const auto found = m_perType.find(header.type());
+	if (found != m_perType.end())
+		found->second.record(latency);
+	return latency;
+}
+
+template<typename Packet, std::size_t Field>
+const LatencyHistogram &PacketLatencyTracker<Packet, Field>::histogram(Type type) const
+{
+	static const LatencyHistogram empty;
+	const auto found = m_perType.find(type.value);
+	return found == m_perType.end() ? empty : found->second;
+}
+
+template<typename Packet, std::size_t Field>
+void PacketLatencyTracker<Packet, Field>::reset()
+{
+	m_all.reset();
+	for (auto &histogram : m_perType)
+		histogram.second.reset();
+}
@@ -0,0 +1,195 @@
+#pragma once
+#include "GenericPacket.h"
+#include <limits>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
+
+/** \brief Converts packet streams between header configurations in bulk
+ *
+ * All complete packets in the input are transcoded per call. Only headers are
+ * rewritten: a whole batch is first scanned, then the output is sized once and
+ * every payload is copied a single time. Alternatively, the packets can be
+ * described by iovecs for writev() or sendmsg(), pointing at the new headers
+ * and at the payloads where they are in the input, so payloads are not copied
+ * at all.
+ *
+ * Types may be translated by a mapping table. Types without a mapping are
+ * kept as they are, unless they do not fit the target type or unmapped types
+ * are dropped. Packets too large for the target size type are dropped as well.
+ */
+template<typename FromS, typename FromT, typename ToS = std::uint32_t, typename ToT = std::uint32_t>
+class PacketTranscoder
+{
+public:
+	using FromPacket = GenericPacket<FromS, FromT>;
+	using ToPacket = GenericPacket<ToS, ToT>;
+	using FromType = typename FromPacket::Type;
+	using ToType = typename ToPacket::Type;
+	using DecodeStatus = typename FromPacket::DecodeStatus;
+
+	/** \brief Transcoded packets as iovecs, see transcode() */
+	class Iovecs
+	{
+	public:
+		/** \brief Two iovecs per packet: its new header and its payload */
+		const std::vector<iovec> &iovecs() const { return m_iovecs; }
+		/** \brief Number of packets described */
+		std::size_t packets() const { return m_iovecs.size() / 2; }
+		/** \brief Number of input bytes consumed, including dropped packets */
+		std::size_t consumed() const { return m_consumed; }
+
+	private:
+		friend class PacketTranscoder;
+
+		std::vector<char> m_headers;
+		std::vector<iovec> m_iovecs;
+		std::size_t m_consumed = 0;
+	};
+
+	PacketTranscoder &setTypeMapping(FromType from, ToType to)
+	{
+		m_typeMapping[from.value] = to.value;
+		return *this;
+	}
+	PacketTranscoder &removeTypeMapping(FromType from)
+	{
+		m_typeMapping.erase(from.value);
+		return *this;
+	}
+	/** \brief Drop packets of types without a mapping instead of keeping their types */
+	void setDropUnmapped(bool drop) { m_dropUnmapped = drop; }
+
+	/** \brief Number of packets dropped because of their type or size */
+	std::size_t droppedPackets() const { return m_dropped; }
+
+	/** \brief Transcode all complete packets at the start of \p input, appending them to \p output
+	 *
+	 * The consumed bytes are removed from \p input in one go. Returns why
+	 * transcoding stopped, like PacketBatch::extractFromData():
+	 * DecodeStatus::Incomplete once \p input does not hold a complete packet,
+	 * or DecodeStatus::Oversized if the next packet's payload is larger than
+	 * \p maxPayloadSize (it is left in \p input).
+	 */
+	DecodeStatus transcode(QByteArray &input, QByteArray &output,
+			std::size_t maxPayloadSize = FromPacket::Header::maxSize());
+	/** \brief Describe the transcoded packets at \p data by iovecs, without copying payloads
+	 *
+	 * At most \p maxPackets packets are described (the default keeps to the
+	 * usual IOV_MAX of 1024). The iovecs point into \p data and \p iovecs, and
+	 * are valid as long as both are. Remove iovecs.consumed() bytes from the
+	 * input once they are written. Returns like the other overload, with
+	 * DecodeStatus::Ok if \p maxPackets were reached.
+	 */
+	DecodeStatus transcode(const char *data, std::size_t size, Iovecs &iovecs, std::size_t maxPackets = 512,
+			std::size_t maxPayloadSize = FromPacket::Header::maxSize());
+
+private:
+	struct Entry
+	{
+		ToT type;
+		ToS size;
+		const char *payload;
+	};
+
+	/* Fills m_entries with the packets to keep, up to maxPackets: */
+	DecodeStatus scan(const char *data, std::size_t size, std::size_t maxPackets, std::size_t maxPayloadSize,
+			std::size_t &consumed);
+	bool translate(FromT from, ToT &to) const;
+
+	std::unordered_map<FromT, ToT> m_typeMapping;
+	bool m_dropUnmapped = false;
+	std::size_t m_dropped = 0;
+	/* Kept between calls, so that steady state transcoding does not allocate: */
+	std::vector<Entry> m_entries;
+};
+
+
+template<typename FromS, typename FromT, typename ToS, typename ToT>
+typename PacketTranscoder<FromS, FromT, ToS, ToT>::DecodeStatus PacketTranscoder<FromS, FromT, ToS, ToT>::transcode(
+		QByteArray &input, QByteArray &output, std::size_t maxPayloadSize)
+{
+	std::size_t consumed;
+	const DecodeStatus status = scan(input.constData(), static_cast<std::size_t>(input.size()),
+			std::numeric_limits<std::size_t>::max(), maxPayloadSize, consumed);
+
+	std::size_t outputSize = 0;
+	for (const Entry &entry : m_entries)
+		outputSize += ToPacket::Header::dataSize() + entry.size;
+
+	auto offset = output.size();
+	output.resize(offset + static_cast<GenericPacketHelper::ByteArraySize>(outputSize));
+	for (const Entry &entry : m_entries)
+	{
+		char *data = output.data() + offset;
+		GenericPacketHelper::RawHeader<ToS, ToT>::toData(std::make_tuple(entry.size, entry.type), data);
+		std::memcpy(data + ToPacket::Header::dataSize(), entry.payload, entry.size);
+		offset += static_cast<GenericPacketHelper::ByteArraySize>(ToPacket::Header::dataSize() + entry.size);
+	}
+
+	input.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(consumed));
+	return status;
+}
+
+template<typename FromS, typename FromT, typename ToS, typename ToT>
+typename PacketTranscoder<FromS, FromT, ToS, ToT>::DecodeStatus PacketTranscoder<FromS, FromT, ToS, ToT>::transcode(
+		const char *data, std::size_t size, Iovecs &iovecs, std::size_t maxPackets, std::size_t maxPayloadSize)
+{
+	const DecodeStatus status = scan(data, size, maxPackets, maxPayloadSize, iovecs.m_consumed);
+
+	/* The headers are all written before pointing at them, as the buffer may
+	 * move while growing: */
+	const std::size_t headerSize = ToPacket::Header::dataSize();
+	iovecs.m_headers.resize(m_entries.size() * headerSize);
+	for (std::size_t i = 0; i < m_entries.size(); ++i)
+		GenericPacketHelper::RawHeader<ToS, ToT>::toData(std::make_tuple(m_entries[i].size, m_entries[i].type),
+				iovecs.m_headers.data() + i * headerSize);
+
+	iovecs.m_iovecs.resize(2 * m_entries.size());
+	for (std::size_t i = 0; i < m_entries.size(); ++i)
+	{
+		iovecs.m_iovecs[2 * i] = { iovecs.m_headers.data() + i * headerSize, headerSize };
+		iovecs.m_iovecs[2 * i + 1] = { const_cast<char *>(m_entries[i].payload), m_entries[i].size };
+	}
+	return status;
+}
+
+template<typename FromS, typename FromT, typename ToS, typename ToT>
+typename PacketTranscoder<FromS, FromT, ToS, ToT>::DecodeStatus PacketTranscoder<FromS, FromT, ToS, ToT>::scan(
+		const char *data, std::size_t size, std::size_t maxPackets, std::size_t maxPayloadSize, std::size_t &consumed)
+{
+	m_entries.clear();
+	consumed = 0;
+	while (m_entries.size() < maxPackets)
+	{
+		const auto packet = FromPacket::tryDecodeView(data + consumed, size - consumed, maxPayloadSize);
+		if (!packet)
+			return packet.status();
+
+		consumed += FromPacket::Header::dataSize() + packet->payloadSize();
+		ToT type;
+		if (packet->payloadSize() > ToPacket::Header::maxSize() || !translate(packet->header.type(), type))
+		{
+			++m_dropped;
+			continue;
+		}
+		m_entries.push_back(Entry{type, static_cast<ToS>(packet->payloadSize()), packet->payloadData});
+	}
+	return DecodeStatus::Ok;
+}
+
+template<typename FromS, typename FromT, typename ToS, typename ToT>
+bool PacketTranscoder<FromS, FromT, ToS, ToT>::translate(FromT from, ToT &to) const
+{
+	const auto mapped = m_typeMapping.find(from);
+	if (mapped != m_typeMapping.end())
+	{
+		to = mapped->second;
+		return true;
+	}
+	if (m_dropUnmapped || static_cast<std::uint64_t>(from) > std::numeric_limits<ToT>::max())
+		return false;
+
+	to = static_cast<ToT>(from);
+	return true;
+}
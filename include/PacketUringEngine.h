@@ -0,0 +1,616 @@
+#pragma once
+#include "GenericPacket.h"
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/** \brief io_uring-based I/O engine for packet stream connections
+ *
+ * Every connection has one multishot receive in flight, which picks buffers
+ * from a ring of provided buffers registered with the kernel. Packets are
+ * decoded straight out of these buffers and passed to the packet handler as
+ * GenericPacket::View. Only a packet straddling two buffers is copied, and
+ * only its own bytes, to make it contiguous.
+ *
+ * Packets sent on a connection are coalesced in one buffer while a send is in
+ * flight. All sends, and re-armed receives, are submitted by the single
+ * io_uring_enter() of the next poll(), which also waits for completions. A
+ * busy engine therefore makes far less than one system call per packet.
+ *
+ * The io_uring system calls are used directly, so there is no dependency on
+ * liburing. Linux 5.19 or later is needed for provided buffer rings, and
+ * Linux 6.0 for multishot receives. On older kernels, every connection falls
+ * back to a single-shot receive re-armed after every completion, once its
+ * multishot receive fails.
+ *
+ * When the submission queue is full and cannot be submitted right away (e.g.
+ * while the completion queue overflows), requests are deferred to the next
+ * poll(), after completions have been handled.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class PacketUringEngine
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Size = typename Packet::Size;
+	using Type = typename Packet::Type;
+	using View = typename Packet::View;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	/** \brief Called for every received packet. The view is only valid during the call */
+	using PacketHandler = std::function<void(int fd, const View &packet)>;
+	/** \brief Called when a connection is closed by the engine
+	 *
+	 * \p error is 0 on end of file, and an errno value otherwise
+	 * (EMSGSIZE if a packet exceeded the maximum payload size).
+	 */
+	using CloseHandler = std::function<void(int fd, int error)>;
+
+	/** \brief Set up the io_uring and its provided buffers
+	 *
+	 * \p bufferCount (a power of two) receive buffers of \p bufferSize bytes
+	 * are shared by all connections. Check isValid() (and errno) for failure.
+	 */
+	explicit PacketUringEngine(unsigned entries = 256, unsigned bufferCount = 256,
+			std::size_t bufferSize = 16 * 1024);
+	~PacketUringEngine();
+	PacketUringEngine(const PacketUringEngine &) = delete;
+	PacketUringEngine &operator=(const PacketUringEngine &) = delete;
+
+	bool isValid() const { return m_ring >= 0; }
+
+	void setPacketHandler(PacketHandler handler) { m_packetHandler = std::move(handler); }
+	void setCloseHandler(CloseHandler handler) { m_closeHandler = std::move(handler); }
+	/** \brief Close connections announcing payloads larger than this */
+	void setMaxPayloadSize(std::size_t size) { m_maxPayloadSize = size; }
+
+	/** \brief Take ownership of the stream socket \p fd and start receiving on it */
+	bool add(int fd);
+	/** \brief Stop serving and close \p fd. The close handler is not called
+	 *
+	 * The descriptor is closed once the kernel has let go of all requests
+	 * on it.
+	 */
+	void remove(int fd);
+
+	/** \brief Queue a packet for sending on the given connection
+	 *
+	 * Returns false if \p fd is unknown.
+	 */
+	bool send(int fd, Type type, const char *payload, std::size_t size);
+	bool send(int fd, const Packet &packet);
+
+	/** \brief Submit queued requests, wait for completions and handle them
+	 *
+	 * A negative timeout waits forever, and 0 does not wait at all. Returns
+	 * the number of completions handled, or -1 on error (errno is then set).
+	 */
+	int poll(int timeoutMs = -1);
+
+private:
+	enum Operation : std::uint64_t
+	{
+		Receive,
+		Send,
+		Cancel,
+	};
+
+	struct Connection
+	{
+		int fd;
+		/* The start of a packet that straddles receive buffers: */
+		std::vector<char> pending;
+		/* Packets queued while a send is in flight: */
+		QByteArray output;
+		/* The buffer being sent, and how much of it the kernel has taken: */
+		QByteArray sending;
+		std::size_t sendOffset = 0;
+		/* Number of requests the kernel has not finished: */
+		int requests = 0;
+		/* Cleared once a multishot receive fails, e.g. as the kernel lacks
+		 * support for it: */
+		bool multishot = true;
+		bool removed = false;
+	};
+
+	io_uring_sqe *nextSqe();
+	int enter(unsigned wait, int timeoutMs);
+	void receive(std::uint64_t id, Connection &connection);
+	void submitSend(std::uint64_t id, Connection &connection);
+	void cancel(std::uint64_t id, Connection &connection);
+	void submitDeferred();
+	void complete(const io_uring_cqe &cqe);
+	void decode(Connection &connection, const char *data, std::size_t size);
+	bool dispatch(Connection &connection, const View &packet);
+	void recycle(unsigned short buffer);
+	void close(Connection &connection, int error);
+	void release(std::uint64_t id, Connection &connection);
+
+	int m_ring = -1;
+	/* Submission queue: */
+	void *m_sqRing = MAP_FAILED;
+	std::size_t m_sqRingSize = 0;
+	unsigned *m_sqHead = nullptr;
+	unsigned *m_sqTail = nullptr;
+	unsigned m_sqMask = 0;
+	unsigned *m_sqArray = nullptr;
+	io_uring_sqe *m_sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+	std::size_t m_sqesSize = 0;
+	unsigned m_sqEntries = 0;
+	/* Completion queue, sharing the submission queue's mapping: */
+	unsigned *m_cqHead = nullptr;
+	unsigned *m_cqTail = nullptr;
+	unsigned m_cqMask = 0;
+	io_uring_cqe *m_cqes = nullptr;
+	/* Provided buffers. The ring's tail overlays the first entry's resv field
+	 * (io_uring_buf_ring::bufs is misplaced when compiled as C++): */
+	io_uring_buf *m_bufferRing = static_cast<io_uring_buf *>(MAP_FAILED);
+	std::size_t m_bufferRingSize = 0;
+	unsigned m_bufferCount;
+	std::size_t m_bufferSize;
+	std::vector<char> m_buffers;
+
+	std::uint64_t m_nextId = 1;
+	std::unordered_map<std::uint64_t, Connection> m_connections;
+	std::unordered_map<int, std::uint64_t> m_ids;
+	std::vector<std::uint64_t> m_pendingSends;
+	/* Requests (as user data) the submission queue had no room for: */
+	std::vector<std::uint64_t> m_deferred;
+	PacketHandler m_packetHandler;
+	CloseHandler m_closeHandler;
+	std::size_t m_maxPayloadSize = Header::maxSize();
+};
+
+
+template<typename S, typename T>
+PacketUringEngine<S, T>::PacketUringEngine(unsigned entries, unsigned bufferCount, std::size_t bufferSize)
+	: m_bufferCount(bufferCount),
+	m_bufferSize(bufferSize),
+	m_buffers(bufferCount * bufferSize)
+{
+	io_uring_params params{};
+	const int ring = static_cast<int>(syscall(SYS_io_uring_setup, entries, &params));
+	if (ring < 0)
+		return;
+
+	/* Both queues share one mapping (IORING_FEAT_SINGLE_MMAP, Linux 5.4): */
+	m_sqRingSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+			params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring, IORING_OFF_SQ_RING);
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+	/* The provided buffer ring must be page aligned, which mmap() is: */
+	m_bufferRingSize = bufferCount * sizeof(io_uring_buf);
+	m_bufferRing = static_cast<io_uring_buf *>(mmap(nullptr, m_bufferRingSize,
+				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+	io_uring_buf_reg registration{};
+	registration.ring_addr = reinterpret_cast<std::uint64_t>(m_bufferRing);
+	registration.ring_entries = bufferCount;
+	registration.bgid = 0;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+			m_sqRing == MAP_FAILED ||
+			m_sqes == MAP_FAILED ||
+			m_bufferRing == MAP_FAILED ||
+			syscall(SYS_io_uring_register, ring, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+	{
+		const int error = errno;
+		::close(ring);
+		errno = error ? error : EINVAL;
+		return;
+	}
+
+	char *sq = static_cast<char *>(m_sqRing);
+	m_sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	m_sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	m_sqEntries = params.sq_entries;
+	m_cqHead = reinterpret_cast<unsigned *>(sq + params.cq_off.head);
+	m_cqTail = reinterpret_cast<unsigned *>(sq + params.cq_off.tail);
+	m_cqMask = *reinterpret_cast<unsigned *>(sq + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe *>(sq + params.cq_off.cqes);
+	m_ring = ring;
+
+	for (unsigned i = 0; i < bufferCount; ++i)
+		recycle(static_cast<unsigned short>(i));
+}
+
+template<typename S, typename T>
+PacketUringEngine<S, T>::~PacketUringEngine()
+{
+	/* Closing the ring cancels all requests, so the memory they refer to
+	 * can be freed afterwards: */
+	if (m_ring >= 0)
+		::close(m_ring);
+	for (const auto &connection : m_connections)
+		::close(connection.second.fd);
+	if (m_bufferRing != MAP_FAILED)
+		munmap(m_bufferRing, m_bufferRingSize);
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqesSize);
+	if (m_sqRing != MAP_FAILED)
+		munmap(m_sqRing, m_sqRingSize);
+}
+
+template<typename S, typename T>
+bool PacketUringEngine<S, T>::add(int fd)
+{
+	if (m_ids.count(fd))
+		return false;
+
+	const std::uint64_t id = m_nextId++;
+	m_ids[fd] = id;
+	Connection &connection = m_connections[id];
+	connection.fd = fd;
+	receive(id, connection);
+	return true;
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::remove(int fd)
+{
+	const auto found = m_ids.find(fd);
+	if (found == m_ids.end())
+		return;
+
+	const std::uint64_t id = found->second;
+	m_ids.erase(found);
+	Connection &connection = m_connections[id];
+	connection.removed = true;
+	connection.output.clear();
+	cancel(id, connection);
+}
+
+template<typename S, typename T>
+bool PacketUringEngine<S, T>::send(int fd, Type type, const char *payload, std::size_t size)
+{
+	GenericPacketHelper::ensureSizeCanHoldPayload(Header::maxSize(), size);
+	const auto found = m_ids.find(fd);
+	if (found == m_ids.end())
+		return false;
+
+	Connection &connection = m_connections[found->second];
+	if (connection.output.isEmpty())
+		m_pendingSends.push_back(found->second);
+
+	const auto offset = connection.output.size();
+	connection.output.resize(offset + static_cast<GenericPacketHelper::ByteArraySize>(Header::dataSize()));
+	Header{Size{static_cast<S>(size)}, type}.toData(connection.output.data() + offset);
+	connection.output.append(payload, static_cast<GenericPacketHelper::ByteArraySize>(size));
+	return true;
+}
+
+template<typename S, typename T>
+bool PacketUringEngine<S, T>::send(int fd, const Packet &packet)
+{
+	return send(fd, Type{packet.header().type()}, packet.payload().constData(),
+			static_cast<std::size_t>(packet.payload().size()));
+}
+
+template<typename S, typename T>
+int PacketUringEngine<S, T>::poll(int timeoutMs)
+{
+	submitDeferred();
+	/* Sends are submitted here, so that everything queued since the last
+	 * poll goes out with a single system call: */
+	for (const auto id : m_pendingSends)
+	{
+		const auto found = m_connections.find(id);
+		if (found != m_connections.end() && found->second.sending.isEmpty())
+			submitSend(id, found->second);
+	}
+	m_pendingSends.clear();
+
+	if (enter(timeoutMs ? 1 : 0, timeoutMs) < 0 && errno != ETIME && errno != EINTR)
+		return -1;
+
+	int count = 0;
+	unsigned head = __atomic_load_n(m_cqHead, __ATOMIC_RELAXED);
+	while (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+	{
+		const io_uring_cqe cqe = m_cqes[head & m_cqMask];
+		/* Hand the entry back before handling it, as handling may submit: */
+		__atomic_store_n(m_cqHead, ++head, __ATOMIC_RELEASE);
+		complete(cqe);
+		++count;
+	}
+	return count;
+}
+
+template<typename S, typename T>
+io_uring_sqe *PacketUringEngine<S, T>::nextSqe()
+{
+	const unsigned tail = *m_sqTail;
+	/* The submission queue is full, so submit it right away. If the kernel
+	 * takes nothing (e.g. EBUSY while the completion queue overflows), the
+	 * caller defers the request to the next poll(): */
+	while (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+	{
+		const int submitted = enter(0, 0);
+		if (submitted < 0 ? errno != EINTR : submitted == 0)
+			return nullptr;
+	}
+
+	const unsigned index = tail & m_sqMask;
+	io_uring_sqe *sqe = &m_sqes[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	m_sqArray[index] = index;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+template<typename S, typename T>
+int PacketUringEngine<S, T>::enter(unsigned wait, int timeoutMs)
+{
+	/* Whatever the kernel has not consumed yet, also after an interrupted
+	 * call, is submitted: */
+	const unsigned submit = *m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	__kernel_timespec timeout{ timeoutMs / 1000, (timeoutMs % 1000) * 1000000LL };
+	io_uring_getevents_arg argument{};
+	argument.ts = reinterpret_cast<std::uint64_t>(&timeout);
+	if (wait && timeoutMs > 0)
+		flags |= IORING_ENTER_EXT_ARG;
+
+	return static_cast<int>(syscall(SYS_io_uring_enter, m_ring, submit, wait, flags,
+				(flags & IORING_ENTER_EXT_ARG) ? static_cast<void *>(&argument) : nullptr,
+				(flags & IORING_ENTER_EXT_ARG) ? sizeof(argument) : 0));
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::receive(std::uint64_t id, Connection &connection)
+{
+	io_uring_sqe *sqe = nextSqe();
+	if (!sqe)
+	{
+		m_deferred.push_back(id << 2 | Receive);
+		return;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = connection.fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->ioprio = connection.multishot ? IORING_RECV_MULTISHOT : 0;
+	sqe->user_data = id << 2 | Receive;
+	++connection.requests;
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::submitSend(std::uint64_t id, Connection &connection)
+{
+	if (connection.sending.isEmpty())
+	{
+		if (connection.output.isEmpty())
+			return;
+		std::swap(connection.sending, connection.output);
+		connection.sendOffset = 0;
+	}
+
+	io_uring_sqe *sqe = nextSqe();
+	if (!sqe)
+	{
+		m_deferred.push_back(id << 2 | Send);
+		return;
+	}
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = connection.fd;
+	sqe->addr = reinterpret_cast<std::uint64_t>(connection.sending.constData() + connection.sendOffset);
+	sqe->len = static_cast<std::uint32_t>(static_cast<std::size_t>(connection.sending.size()) - connection.sendOffset);
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = id << 2 | Send;
+	++connection.requests;
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::cancel(std::uint64_t id, Connection &connection)
+{
+	/* Cancel everything on the connection. It is released once the kernel
+	 * has completed the last of its requests, which is at the earliest when
+	 * this cancellation completes, so never while it is being handled: */
+	io_uring_sqe *sqe = nextSqe();
+	if (!sqe)
+	{
+		m_deferred.push_back(id << 2 | Cancel);
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = connection.fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = id << 2 | Cancel;
+	++connection.requests;
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::submitDeferred()
+{
+	std::vector<std::uint64_t> deferred;
+	std::swap(deferred, m_deferred);
+	for (const auto request : deferred)
+	{
+		const std::uint64_t id = request >> 2;
+		const auto found = m_connections.find(id);
+		if (found == m_connections.end())
+			continue;
+
+		Connection &connection = found->second;
+		switch (static_cast<Operation>(request & 3))
+		{
+		case Receive:
+			if (!connection.removed)
+				receive(id, connection);
+			break;
+		case Send:
+			if (!connection.removed)
+				submitSend(id, connection);
+			break;
+		case Cancel:
+			cancel(id, connection);
+			break;
+		}
+	}
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::complete(const io_uring_cqe &cqe)
+{
+	const std::uint64_t id = cqe.user_data >> 2;
+	const auto operation = static_cast<Operation>(cqe.user_data & 3);
+	const bool hasBuffer = cqe.flags & IORING_CQE_F_BUFFER;
+	const auto buffer = static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+
+	const auto found = m_connections.find(id);
+	if (found == m_connections.end())
+	{
+		if (hasBuffer)
+			recycle(buffer);
+		return;
+	}
+
+	Connection &connection = found->second;
+	const bool finished = operation != Receive || !(cqe.flags & IORING_CQE_F_MORE);
+	if (finished)
+		--connection.requests;
+
+	if (connection.removed)
+	{
+		if (hasBuffer)
+			recycle(buffer);
+		release(id, connection);
+		return;
+	}
+
+	if (operation == Receive)
+	{
+		if (cqe.res > 0 && hasBuffer)
+			decode(connection, m_buffers.data() + buffer * m_bufferSize, static_cast<std::size_t>(cqe.res));
+		if (hasBuffer)
+			recycle(buffer);
+
+		if (connection.removed)
+			release(id, connection);
+		else if (cqe.res == -EINVAL && connection.multishot)
+		{
+			/* Multishot receives need Linux 6.0, so fall back to re-arming
+			 * a single-shot receive after every completion. If that fails
+			 * as well, the error is real and closes the connection: */
+			connection.multishot = false;
+			receive(id, connection);
+		}
+		else if (cqe.res == 0)
+			close(connection, 0);
+		else if (cqe.res < 0 && cqe.res != -ENOBUFS)
+			close(connection, -cqe.res);
+		/* Multishot receives stop when running out of buffers, which have
+		 * been recycled by now: */
+		else if (finished)
+			receive(id, connection);
+		return;
+	}
+
+	if (cqe.res < 0)
+	{
+		close(connection, -cqe.res);
+		return;
+	}
+	connection.sendOffset += static_cast<std::size_t>(cqe.res);
+	if (connection.sendOffset == static_cast<std::size_t>(connection.sending.size()))
+		connection.sending.clear();
+	/* Resubmit the rest of a partial send, or what was queued meanwhile: */
+	submitSend(id, connection);
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::decode(Connection &connection, const char *data, std::size_t size)
+{
+	/* Complete a packet started in a previous buffer, copying its bytes: */
+	while (!connection.pending.empty() && size)
+	{
+		const auto header = Header::tryDecode(connection.pending.data(), connection.pending.size());
+		if (header && header->size() > m_maxPayloadSize)
+		{
+			close(connection, EMSGSIZE);
+			return;
+		}
+		const std::size_t packetSize = Header::dataSize() + (header ? header->size() : 0);
+		const std::size_t copied = std::min(size, packetSize - connection.pending.size());
+		connection.pending.insert(connection.pending.end(), data, data + copied);
+		data += copied;
+		size -= copied;
+
+		if (header && connection.pending.size() == packetSize)
+		{
+			if (!dispatch(connection, View{*header, connection.pending.data() + Header::dataSize()}))
+				return;
+			connection.pending.clear();
+		}
+	}
+
+	/* Packets within the buffer are not copied: */
+	auto packet = Packet::tryDecodeView(data, size, m_maxPayloadSize);
+	while (packet)
+	{
+		if (!dispatch(connection, *packet))
+			return;
+		data += Header::dataSize() + packet->payloadSize();
+		size -= Header::dataSize() + packet->payloadSize();
+		packet = Packet::tryDecodeView(data, size, m_maxPayloadSize);
+	}
+
+	if (packet.status() == DecodeStatus::Oversized)
+	{
+		close(connection, EMSGSIZE);
+		return;
+	}
+	connection.pending.insert(connection.pending.end(), data, data + size);
+}
+
+template<typename S, typename T>
+bool PacketUringEngine<S, T>::dispatch(Connection &connection, const View &packet)
+{
+	if (m_packetHandler)
+		m_packetHandler(connection.fd, packet);
+
+	/* The handler may have removed the connection: */
+	return !connection.removed;
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::recycle(unsigned short buffer)
+{
+	const unsigned short tail = m_bufferRing->resv;
+	io_uring_buf &entry = m_bufferRing[tail & (m_bufferCount - 1)];
+	entry.addr = reinterpret_cast<std::uint64_t>(m_buffers.data() + buffer * m_bufferSize);
+	entry.len = static_cast<std::uint32_t>(m_bufferSize);
+	entry.bid = buffer;
+	__atomic_store_n(&m_bufferRing->resv, static_cast<unsigned short>(tail + 1), __ATOMIC_RELEASE);
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::close(Connection &connection, int error)
+{
+	const int fd = connection.fd;
+	remove(fd);
+	if (m_closeHandler)
+		m_closeHandler(fd, error);
+}
+
+template<typename S, typename T>
+void PacketUringEngine<S, T>::release(std::uint64_t id, Connection &connection)
+{
+	if (connection.requests)
+		return;
+
+	::close(connection.fd);
+	m_connections.erase(id);
+}
@@ -0,0 +1,402 @@
+#pragma once
+#include "GenericPacket.h"
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/** \brief Single-producer single-consumer ring of packets in shared memory
+ *
+ * The ring lives in a memfd that is shared between two processes (pass fd()
+ * to the other process, e.g. with SCM_RIGHTS, and attach() to it there). The
+ * producer writes frames, a Header followed by the payload, directly into the
+ * ring, and the consumer decodes them in place as GenericPacket::View.
+ *
+ * The data area is mapped twice back to back, so every frame is contiguous in
+ * memory even when it wraps around the end of the ring.
+ *
+ * Neither side makes a system call as long as the other side keeps up. A
+ * futex wake-up is only issued when the consumer sleeps in waitForData() on an
+ * empty ring (or the producer in waitForSpace() on a full one).
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class SharedPacketRing
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Size = typename Packet::Size;
+	using Type = typename Packet::Type;
+	using View = typename Packet::View;
+	using DecodeStatus = typename Packet::DecodeStatus;
+
+	/** \brief Create a new ring with room for at least \p capacity bytes of frames
+	 *
+	 * The capacity is rounded up to a multiple of the page size. Returns
+	 * nullptr (with errno set) on failure.
+	 */
+	static std::unique_ptr<SharedPacketRing> create(std::size_t capacity);
+	/** \brief Attach to a ring created by another process
+	 *
+	 * Takes ownership of \p fd. Returns nullptr (with errno set) on failure,
+	 * with EINVAL if the memfd does not hold a ring.
+	 */
+	static std::unique_ptr<SharedPacketRing> attach(int fd);
+
+	~SharedPacketRing();
+	SharedPacketRing(const SharedPacketRing &) = delete;
+	SharedPacketRing &operator=(const SharedPacketRing &) = delete;
+
+	/** \brief The memfd backing the ring */
+	int fd() const { return m_fd; }
+	std::size_t capacity() const { return m_capacity; }
+
+	/* Producer side: */
+
+	/** \brief Write a frame unless the ring lacks room for it
+	 *
+	 * Frames larger than capacity() never fit.
+	 */
+	bool tryWrite(Type type, const char *payload, std::size_t size);
+	bool tryWrite(const Packet &packet);
+	/** \brief Reserve room for a frame and write its header
+	 *
+	 * Returns where to write the \p size bytes of payload, or nullptr if the
+	 * ring lacks room or its shared positions are corrupt. The frame is
+	 * published by commit().
+	 */
+	char *tryReserve(Type type, std::size_t size);
+	void commit();
+	/** \brief Block until a frame with \p size bytes of payload fits
+	 *
+	 * A negative timeout waits forever. Returns false on timeout, and right
+	 * away for a frame that can never fit.
+	 */
+	bool waitForSpace(std::size_t size, int timeoutMs = -1);
+
+	/* Consumer side: */
+
+	/** \brief Decode the next frame in place
+	 *
+	 * The view stays valid until it is passed to release(). Returns
+	 * DecodeStatus::Invalid if the shared positions are corrupt.
+	 */
+	typename Packet::template Result<View> tryRead() const;
+	void release(const View &packet);
+	/** \brief Block until the ring is not empty
+	 *
+	 * A negative timeout waits forever. Returns false on timeout.
+	 */
+	bool waitForData(int timeoutMs = -1);
+
+private:
+	/* Shared state, placed in the first page of the memfd. Positions are
+	 * monotonically increasing byte counts: */
+	struct Control
+	{
+		std::uint64_t capacity;
+		alignas(64) std::atomic<std::uint64_t> head;
+		alignas(64) std::atomic<std::uint64_t> tail;
+		alignas(64) std::atomic<std::uint32_t> dataFutex;
+		std::atomic<std::uint32_t> consumerWaiting;
+		alignas(64) std::atomic<std::uint32_t> spaceFutex;
+		std::atomic<std::uint32_t> producerWaiting;
+	};
+
+	SharedPacketRing(int fd, std::size_t capacity, Control *control, char *data);
+	static std::unique_ptr<SharedPacketRing> map(int fd, std::size_t capacity);
+	static std::size_t controlSize();
+	static bool fitsInto(std::size_t size, std::size_t space);
+	static timespec deadline(int timeoutMs);
+	static bool wait(std::atomic<std::uint32_t> &futex, std::uint32_t value, const timespec *deadline);
+	static void wake(std::atomic<std::uint32_t> &futex);
+
+	int m_fd;
+	std::size_t m_capacity;
+	Control *m_control;
+	char *m_data;
+	/* Size of the frame reserved, but not yet committed, by the producer: */
+	std::size_t m_reserved = 0;
+};
+
+
+template<typename S, typename T>
+std::unique_ptr<SharedPacketRing<S, T>> SharedPacketRing<S, T>::create(std::size_t capacity)
+{
+	const auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+	capacity = (capacity + pageSize - 1) / pageSize * pageSize;
+
+	const int fd = static_cast<int>(syscall(SYS_memfd_create, "GenericPacket ring", MFD_CLOEXEC));
+	if (fd < 0)
+		return nullptr;
+	if (ftruncate(fd, static_cast<off_t>(controlSize() + capacity)) < 0)
+	{
+		const int error = errno;
+		close(fd);
+		errno = error;
+		return nullptr;
+	}
+
+	auto ring = map(fd, capacity);
+	if (ring)
+	{
+		/* The memfd is zero-filled, so only the capacity needs setting: */
+		ring->m_control->capacity = capacity;
+	}
+	return ring;
+}
+
+template<typename S, typename T>
+std::unique_ptr<SharedPacketRing<S, T>> SharedPacketRing<S, T>::attach(int fd)
+{
+	struct stat status;
+	void *control = MAP_FAILED;
+	if (fstat(fd, &status) == 0)
+	{
+		if (status.st_size >= static_cast<off_t>(controlSize()))
+			control = mmap(nullptr, controlSize(), PROT_READ, MAP_SHARED, fd, 0);
+		else
+			errno = EINVAL;
+	}
+	if (control == MAP_FAILED)
+	{
+		const int error = errno;
+		close(fd);
+		errno = error;
+		return nullptr;
+	}
+	const auto capacity = static_cast<const Control *>(control)->capacity;
+	munmap(control, controlSize());
+
+	/* The capacity comes from the other process, so it must match the size
+	 * of the memfd, or the mappings would reach past its end: */
+	const auto pageSize = static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+	if (capacity == 0 || capacity % pageSize != 0 ||
+			capacity != static_cast<std::uint64_t>(status.st_size) - controlSize())
+	{
+		close(fd);
+		errno = EINVAL;
+		return nullptr;
+	}
+
+	return map(fd, static_cast<std::size_t>(capacity));
+}
+
+template<typename S, typename T>
+std::unique_ptr<SharedPacketRing<S, T>> SharedPacketRing<S, T>::map(int fd, std::size_t capacity)
+{
+	void *control = mmap(nullptr, controlSize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	/* Reserve address space for two copies of the data area, and map the
+	 * same part of the memfd into both halves: */
+	void *data = mmap(nullptr, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	const bool mapped =
+		control != MAP_FAILED &&
+		data != MAP_FAILED &&
+		mmap(data, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+				static_cast<off_t>(controlSize())) != MAP_FAILED &&
+		mmap(static_cast<char *>(data) + capacity, capacity, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, static_cast<off_t>(controlSize())) != MAP_FAILED;
+	if (!mapped)
+	{
+		const int error = errno;
+		if (control != MAP_FAILED)
+			munmap(control, controlSize());
+		if (data != MAP_FAILED)
+			munmap(data, 2 * capacity);
+		close(fd);
+		errno = error;
+		return nullptr;
+	}
+
+	return std::unique_ptr<SharedPacketRing>(new SharedPacketRing(
+				fd, capacity, static_cast<Control *>(control), static_cast<char *>(data)));
+}
+
+template<typename S, typename T>
+SharedPacketRing<S, T>::SharedPacketRing(int fd, std::size_t capacity, Control *control, char *data)
+	: m_fd(fd),
+	m_capacity(capacity),
+	m_control(control),
+	m_data(data)
+{
+	/* Atomics shared between processes must not be implemented with locks: */
+	static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "Atomics are not lock-free");
+}
+
+template<typename S, typename T>
+SharedPacketRing<S, T>::~SharedPacketRing()
+{
+	munmap(m_data, 2 * m_capacity);
+	munmap(m_control, controlSize());
+	close(m_fd);
+}
+
+template<typename S, typename T>
+bool SharedPacketRing<S, T>::tryWrite(Type type, const char *payload, std::size_t size)
+{
+	char *data = tryReserve(type, size);
+	if (!data)
+		return false;
+
+	std::memcpy(data, payload, size);
+	commit();
+	return true;
+}
+
+template<typename S, typename T>
+bool SharedPacketRing<S, T>::tryWrite(const Packet &packet)
+{
+	return tryWrite(Type{packet.header().type()}, packet.payload().constData(),
+			static_cast<std::size_t>(packet.payload().size()));
+}
+
+template<typename S, typename T>
+char *SharedPacketRing<S, T>::tryReserve(Type type, std::size_t size)
+{
+	const auto head = m_control->head.load(std::memory_order_relaxed);
+	const auto tail = m_control->tail.load(std::memory_order_acquire);
+	/* The positions are written by the other process, so a fill level beyond
+	 * the capacity means they are corrupt: */
+	if (head - tail > m_capacity || !fitsInto(size, m_capacity - (head - tail)))
+		return nullptr;
+
+	const std::size_t frameSize = Header::dataSize() + size;
+	char *frame = m_data + head % m_capacity;
+	Header{Size{static_cast<S>(size)}, type}.toData(frame);
+	m_reserved = frameSize;
+	return frame + Header::dataSize();
+}
+
+template<typename S, typename T>
+void SharedPacketRing<S, T>::commit()
+{
+	const auto head = m_control->head.load(std::memory_order_relaxed);
+	m_control->head.store(head + m_reserved, std::memory_order_seq_cst);
+	m_reserved = 0;
+
+	/* Only a consumer that found the ring empty can be asleep. Storing head
+	 * before loading tail and the waiting flag pairs with the reverse order in
+	 * waitForData(), so a wake-up cannot be missed: */
+	if (m_control->tail.load(std::memory_order_seq_cst) == head &&
+			m_control->consumerWaiting.load(std::memory_order_seq_cst))
+		wake(m_control->dataFutex);
+}
+
+template<typename S, typename T>
+bool SharedPacketRing<S, T>::waitForSpace(std::size_t size, int timeoutMs)
+{
+	/* Waiting for a frame that never fits would block forever: */
+	if (!fitsInto(size, m_capacity))
+		return false;
+
+	const timespec until = deadline(timeoutMs);
+	for (;;)
+	{
+		const auto value = m_control->spaceFutex.load(std::memory_order_acquire);
+		m_control->producerWaiting.store(1, std::memory_order_seq_cst);
+		const auto head = m_control->head.load(std::memory_order_relaxed);
+		const auto used = head - m_control->tail.load(std::memory_order_seq_cst);
+		/* Corrupt positions are left to tryReserve() to reject: */
+		if (used > m_capacity || fitsInto(size, m_capacity - used))
+			break;
+		if (!wait(m_control->spaceFutex, value, timeoutMs < 0 ? nullptr : &until))
+		{
+			m_control->producerWaiting.store(0, std::memory_order_relaxed);
+			return false;
+		}
+	}
+	m_control->producerWaiting.store(0, std::memory_order_relaxed);
+	return true;
+}
+
+template<typename S, typename T>
+typename GenericPacket<S, T>::template Result<typename GenericPacket<S, T>::View>
+SharedPacketRing<S, T>::tryRead() const
+{
+	const auto tail = m_control->tail.load(std::memory_order_relaxed);
+	const auto head = m_control->head.load(std::memory_order_acquire);
+	/* Frames are only contiguous up to the capacity, past the double mapping
+	 * lies other memory: */
+	if (head - tail > m_capacity)
+		return DecodeStatus::Invalid;
+	return Packet::tryDecodeView(m_data + tail % m_capacity, static_cast<std::size_t>(head - tail));
+}
+
+template<typename S, typename T>
+void SharedPacketRing<S, T>::release(const View &packet)
+{
+	const auto tail = m_control->tail.load(std::memory_order_relaxed);
+	m_control->tail.store(tail + Header::dataSize() + packet.payloadSize(), std::memory_order_seq_cst);
+
+	if (m_control->producerWaiting.load(std::memory_order_seq_cst))
+		wake(m_control->spaceFutex);
+}
+
+template<typename S, typename T>
+bool SharedPacketRing<S, T>::waitForData(int timeoutMs)
+{
+	const timespec until = deadline(timeoutMs);
+	for (;;)
+	{
+		const auto value = m_control->dataFutex.load(std::memory_order_acquire);
+		m_control->consumerWaiting.store(1, std::memory_order_seq_cst);
+		if (m_control->head.load(std::memory_order_seq_cst) != m_control->tail.load(std::memory_order_relaxed))
+			break;
+		if (!wait(m_control->dataFutex, value, timeoutMs < 0 ? nullptr : &until))
+		{
+			m_control->consumerWaiting.store(0, std::memory_order_relaxed);
+			return false;
+		}
+	}
+	m_control->consumerWaiting.store(0, std::memory_order_relaxed);
+	return true;
+}
+
+template<typename S, typename T>
+std::size_t SharedPacketRing<S, T>::controlSize()
+{
+	return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+template<typename S, typename T>
+bool SharedPacketRing<S, T>::fitsInto(std::size_t size, std::size_t space)
+{
+	return size <= Header::maxSize() && size <= space && Header::dataSize() <= space - size;
+}
+
+template<typename S, typename T>
+timespec SharedPacketRing<S, T>::deadline(int timeoutMs)
+{
+	timespec now{};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timeoutMs < 0)
+		return now;
+
+	const long nanoseconds = now.tv_nsec + (timeoutMs % 1000) * 1000000L;
+	return timespec{ now.tv_sec + timeoutMs / 1000 + nanoseconds / 1000000000L, nanoseconds % 1000000000L };
+}
+
+template<typename S, typename T>
+bool SharedPacketRing<S, T>::wait(std::atomic<std::uint32_t> &futex, std::uint32_t value, const timespec *deadline)
+{
+	/* The futex is shared between processes, so FUTEX_PRIVATE_FLAG must not
+	 * be used. FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline,
+	 * so waiting again after a spurious wake-up does not restart the timeout.
+	 * Spurious wake-ups, EINTR and EAGAIN (the value already changed) are
+	 * handled by the callers re-checking the ring: */
+	const long result = syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&futex), FUTEX_WAIT_BITSET,
+			value, deadline, nullptr, FUTEX_BITSET_MATCH_ANY);
+	return result == 0 || errno != ETIMEDOUT;
+}
+
+template<typename S, typename T>
+void SharedPacketRing<S, T>::wake(std::atomic<std::uint32_t> &futex)
+{
+	futex.fetch_add(1, std::memory_order_seq_cst);
+	syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&futex), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
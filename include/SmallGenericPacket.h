@@ -0,0 +1,234 @@
+#pragma once
+#include "GenericPacket.h"
+#include <array>
+#include <cstring>
+
+/** \brief A GenericPacket that keeps payloads of up to N bytes inline
+ *
+ * Payloads no larger than N are stored in a fixed array next to the header,
+ * so creating, decoding, copying and moving such packets never allocates.
+ * Larger payloads fall back to a heap-allocated QByteArray. The wire format is
+ * identical to that of GenericPacket<S, T>.
+ */
+template<std::size_t N, typename S = std::uint32_t, typename T = std::uint32_t>
+class SmallGenericPacket
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using Size = typename Packet::Size;
+	using Type = typename Packet::Type;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	using Result = typename Packet::template Result<SmallGenericPacket>;
+	using ConstData = GenericPacketHelper::ConstData;
+
+	SmallGenericPacket() = default;
+	SmallGenericPacket(Type type, const char *payload, std::size_t size);
+	SmallGenericPacket(Type type, const QByteArray &payload);
+	SmallGenericPacket(Type type, QByteArray &&payload);
+	explicit SmallGenericPacket(Packet &&packet);
+
+	/** \brief The largest payload stored without allocating */
+	static constexpr std::size_t inlineCapacity() { return N; }
+
+	static bool hasCompletePacket(ConstData data) { return Packet::hasCompletePacket(data); }
+	/** \brief Deep-copy a packet from the given raw data
+	 *
+	 * Throws a std::length_error if the packet is not complete.
+	 */
+	static SmallGenericPacket fromData(ConstData data);
+	/** \brief Extract bytes from the raw data and construct a packet
+	 *
+	 * Throws a std::length_error if the packet is not complete.
+	 */
+	static SmallGenericPacket extractFromData(QByteArray &data);
+	/** \brief See GenericPacket::tryDecode() */
+	static Result tryDecode(ConstData data, std::size_t maxPayloadSize = Header::maxSize());
+	/** \brief See GenericPacket::tryExtract() */
+	static Result tryExtract(QByteArray &data, std::size_t maxPayloadSize = Header::maxSize());
+
+	/** \brief The header, whose size is only changed along with the payload, by setPayload() */
+	const Header &header() const { return m_header; }
+	SmallGenericPacket &setType(Type type)
+	{
+		m_header.setType(type);
+		return *this;
+	}
+
+	/** \brief Whether the payload is stored inline (does not use the heap) */
+	bool isInline() const { return m_header.size() <= N; }
+	const char *payloadData() const { return isInline() ? m_inline.data() : m_heap.constData(); }
+	std::size_t payloadSize() const { return m_header.size(); }
+	/** \brief The payload as a QByteArray
+	 *
+	 * Inline payloads are deep-copied, heap payloads are shared.
+	 */
+	QByteArray payload() const;
+
+	SmallGenericPacket &setPayload(const char *payload, std::size_t size);
+	SmallGenericPacket &setPayload(const QByteArray &payload);
+	SmallGenericPacket &setPayload(QByteArray &&payload);
+
+	QByteArray toData() const;
+	std::size_t dataSize() const { return Header::dataSize() + payloadSize(); }
+
+	/** \brief Convert to a plain GenericPacket, moving any heap payload */
+	Packet toGenericPacket() &&;
+
+private:
+	Header m_header;
+	std::array<char, N> m_inline;
+	QByteArray m_heap;
+};
+
+
+template<std::size_t N, typename S, typename T>
+SmallGenericPacket<N, S, T>::SmallGenericPacket(Type type, const char *payload, std::size_t size)
+{
+	m_header.setType(type);
+	setPayload(payload, size);
+}
+
+template<std::size_t N, typename S, typename T>
+SmallGenericPacket<N, S, T>::SmallGenericPacket(Type type, const QByteArray &payload)
+{
+	m_header.setType(type);
+	setPayload(payload);
+}
+
+template<std::size_t N, typename S, typename T>
+SmallGenericPacket<N, S, T>::SmallGenericPacket(Type type, QByteArray &&payload)
+{
+	m_header.setType(type);
+	setPayload(std::move(payload));
+}
+
+template<std::size_t N, typename S, typename T>
+SmallGenericPacket<N, S, T>::SmallGenericPacket(Packet &&packet)
+	: SmallGenericPacket(Type{packet.header().type()}, std::move(packet.payload()))
+{
+}
+
+template<std::size_t N, typename S, typename T>
+SmallGenericPacket<N, S, T> SmallGenericPacket<N, S, T>::fromData(ConstData data)
+{
+	auto packet = tryDecode(data);
+	if (!packet)
+		GENERICPACKET_THROW(std::length_error("Data is not big enough to contain a packet"));
+
+	return std::move(*packet);
+}
+
+template<std::size_t N, typename S, typename T>
+SmallGenericPacket<N, S, T> SmallGenericPacket<N, S, T>::extractFromData(QByteArray &data)
+{
+	auto packet = tryExtract(data);
+	if (!packet)
+		GENERICPACKET_THROW(std::length_error("Data is not big enough to contain a packet"));
+
+	return std::move(*packet);
+}
+
+template<std::size_t N, typename S, typename T>
+typename SmallGenericPacket<N, S, T>::Result SmallGenericPacket<N, S, T>::tryDecode(
+		ConstData data, std::size_t maxPayloadSize)
+{
+	const auto view = Packet::tryDecodeView(data, maxPayloadSize);
+	if (!view)
+		return view.status();
+
+	SmallGenericPacket packet;
+	packet.m_header = view->header;
+	if (packet.isInline())
+		std::memcpy(packet.m_inline.data(), view->payloadData, view->payloadSize());
+	else
+		packet.m_heap = QByteArray(view->payloadData,
+				static_cast<GenericPacketHelper::ByteArraySize>(view->payloadSize()));
+
+	return packet;
+}
+
+template<std::size_t N, typename S, typename T>
+typename SmallGenericPacket<N, S, T>::Result SmallGenericPacket<N, S, T>::tryExtract(
+		QByteArray &data, std::size_t maxPayloadSize)
+{
+	const auto header = Header::tryDecode(data);
+	/* Large payloads spanning the rest of the data take over its buffer: */
+	if (header && header->size() > N && header->size() <= maxPayloadSize &&
+			Header::dataSize() + header->size() == static_cast<std::size_t>(data.size()))
+		return SmallGenericPacket{Packet::fromData(std::move(data))};
+
+	auto packet = tryDecode(data, maxPayloadSize);
+	if (packet)
+		data.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(packet->dataSize()));
+
+	return packet;
+}
+
+template<std::size_t N, typename S, typename T>
+QByteArray SmallGenericPacket<N, S, T>::payload() const
+{
+	if (isInline())
+		return QByteArray(m_inline.data(), static_cast<GenericPacketHelper::ByteArraySize>(payloadSize()));
+
+	return m_heap;
+}
+
+template<std::size_t N, typename S, typename T>
+SmallGenericPacket<N, S, T> &SmallGenericPacket<N, S, T>::setPayload(const char *payload, std::size_t size)
+{
+	GenericPacketHelper::ensureSizeCanHoldPayload(Header::maxSize(), size);
+	m_header.setSize(Size{static_cast<S>(size)});
+	if (isInline())
+	{
+		if (size)
+			std::memcpy(m_inline.data(), payload, size);
+		m_heap = QByteArray();
+	}
+	else
+		m_heap = QByteArray(payload, static_cast<GenericPacketHelper::ByteArraySize>(size));
+
+	return *this;
+}
+
+template<std::size_t N, typename S, typename T>
+SmallGenericPacket<N, S, T> &SmallGenericPacket<N, S, T>::setPayload(const QByteArray &payload)
+{
+	if (static_cast<std::size_t>(payload.size()) <= N)
+		return setPayload(payload.constData(), static_cast<std::size_t>(payload.size()));
+
+	GenericPacketHelper::ensureSizeCanHoldPayload(Header::maxSize(), static_cast<std::size_t>(payload.size()));
+	/* Share rather than copy the heap data: */
+	m_heap = payload;
+	m_header.setSize(Size{static_cast<S>(m_heap.size())});
+	return *this;
+}
+
+template<std::size_t N, typename S, typename T>
+SmallGenericPacket<N, S, T> &SmallGenericPacket<N, S, T>::setPayload(QByteArray &&payload)
+{
+	if (static_cast<std::size_t>(payload.size()) <= N)
+		return setPayload(payload.constData(), static_cast<std::size_t>(payload.size()));
+
+	GenericPacketHelper::ensureSizeCanHoldPayload(Header::maxSize(), static_cast<std::size_t>(payload.size()));
+	m_heap = std::move(payload);
+	m_header.setSize(Size{static_cast<S>(m_heap.size())});
+	return *this;
+}
+
+template<std::size_t N, typename S, typename T>
+QByteArray SmallGenericPacket<N, S, T>::toData() const
+{
+	QByteArray data = m_header.toData();
+	data.append(payloadData(), static_cast<GenericPacketHelper::ByteArraySize>(payloadSize()));
+	return data;
+}
+
+template<std::size_t N, typename S, typename T>
+typename SmallGenericPacket<N, S, T>::Packet SmallGenericPacket<N, S, T>::toGenericPacket() &&
+{
+	if (isInline())
+		return Packet{Type{m_header.type()}, payload()};
+
+	return Packet{Type{m_header.type()}, std::move(m_heap)};
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include "GenericPacket.h"
+#include "PacketSizeLimits.h"
+#include <algorithm>
+#include <functional>
+
+/** \brief Decodes a packet stream, delivering payloads in chunks as they arrive
+ *
+ * Nothing but a partial header is ever buffered. Once a header is complete,
+ * the header handler is called, and the payload bytes are passed to the chunk
+ * handler straight from the data fed to the decoder, as they arrive. The end
+ * handler is called after the last chunk. Memory use is thus constant, no
+ * matter how large the announced payloads are, so they can be processed or
+ * spilled to disk on the fly.
+ *
+ * Packets over their type's limit in PacketSizeLimits are skipped: their
+ * payload bytes are counted off without calling any handler but the discard
+ * handler.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class StreamingPacketDecoder
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	using ConstData = GenericPacketHelper::ConstData;
+	using HeaderHandler = std::function<void(const Header &header)>;
+	/** \brief Called with the next part of the current payload
+	 *
+	 * The data is only valid during the call.
+	 */
+	using ChunkHandler = std::function<void(const char *data, std::size_t size)>;
+	/** \brief Called when all of the current payload has been delivered */
+	using EndHandler = std::function<void(const Header &header)>;
+	using Limits = PacketSizeLimits<S, T>;
+	using DiscardHandler = typename Limits::DiscardHandler;
+
+	void setHeaderHandler(HeaderHandler handler) { m_headerHandler = std::move(handler); }
+	void setChunkHandler(ChunkHandler handler) { m_chunkHandler = std::move(handler); }
+	void setEndHandler(EndHandler handler) { m_endHandler = std::move(handler); }
+	/** \brief Called when the header of a packet to be skipped is parsed */
+	void setDiscardHandler(DiscardHandler handler) { m_discardHandler = std::move(handler); }
+	/** \brief Stop decoding on headers announcing payloads larger than this */
+	void setMaxPayloadSize(std::size_t size) { m_maxPayloadSize = size; }
+	/** \brief Skip packets over their type's limit */
+	void setSizeLimits(Limits limits) { m_limits = std::move(limits); }
+
+	/** \brief Number of packets skipped because of their size */
+	std::size_t discardedPackets() const { return m_discardedPackets; }
+	/** \brief Number of payload bytes skipped */
+	std::size_t discardedBytes() const { return m_discardedBytes; }
+
+	/** \brief Decode \p size bytes at \p data, calling the handlers
+	 *
+	 * All bytes are consumed unless decoding has stopped. Returns
+	 * DecodeStatus::Ok, or why decoding stopped (see status()).
+	 */
+	DecodeStatus feed(const char *data, std::size_t size);
+	DecodeStatus feed(ConstData data);
+
+	/** \brief DecodeStatus::Ok, or why decoding stopped (e.g. DecodeStatus::Oversized) */
+	DecodeStatus status() const { return m_status; }
+	/** \brief Whether the decoder is between packets */
+	bool isIdle() const { return m_headerRead == 0; }
+	/** \brief The header of the payload being delivered. Only valid if not idle */
+	const Header &currentHeader() const { return m_header; }
+	/** \brief Number of payload bytes still to be delivered for the current packet */
+	std::size_t remainingPayload() const { return m_remaining; }
+	/** \brief Drop any partial packet and resume decoding from the next byte fed */
+	void reset();
+
+private:
+	void beginPacket();
+	void endPacket();
+
+	HeaderHandler m_headerHandler;
+	ChunkHandler m_chunkHandler;
+	EndHandler m_endHandler;
+	DiscardHandler m_discardHandler;
+	std::size_t m_maxPayloadSize = Header::maxSize();
+	Limits m_limits;
+	DecodeStatus m_status = DecodeStatus::Ok;
+	std::size_t m_discardedPackets = 0;
+	std::size_t m_discardedBytes = 0;
+
+	char m_headerData[sizeof(GenericPacketHelper::RawHeader<S, T>)];
+	std::size_t m_headerRead = 0;
+	Header m_header;
+	std::size_t m_remaining = 0;
+	bool m_discarding = false;
+};
+
+
+template<typename S, typename T>
+typename StreamingPacketDecoder<S, T>::DecodeStatus StreamingPacketDecoder<S, T>::feed(const char *data, std::size_t size)
+{
+	while (size && m_status == DecodeStatus::Ok)
+	{
+		if (m_headerRead < Header::dataSize())
+		{
+			const std::size_t copied = std::min(size, Header::dataSize() - m_headerRead);
+			std::memcpy(m_headerData + m_headerRead, data, copied);
+			m_headerRead += copied;
+			data += copied;
+			size -= copied;
+			if (m_headerRead == Header::dataSize())
+				beginPacket();
+			continue;
+		}
+
+		const std::size_t chunk = std::min(size, m_remaining);
+		m_remaining -= chunk;
+		if (m_discarding)
+			m_discardedBytes += chunk;
+		else if (m_chunkHandler)
+			m_chunkHandler(data, chunk);
+		data += chunk;
+		size -= chunk;
+		if (!m_remaining)
+			endPacket();
+	}
+	return m_status;
+}
+
+template<typename S, typename T>
+typename StreamingPacketDecoder<S, T>::DecodeStatus StreamingPacketDecoder<S, T>::feed(ConstData data)
+{
+	return feed(data.constData(), static_cast<std::size_t>(data.size()));
+}
+
+template<typename S, typename T>
+void StreamingPacketDecoder<S, T>::reset()
+{
+	m_status = DecodeStatus::Ok;
+	m_headerRead = 0;
+	m_remaining = 0;
+}
+
+template<typename S, typename T>
+void StreamingPacketDecoder<S, T>::beginPacket()
+{
+	m_header = *Header::tryDecode(m_headerData, Header::dataSize());
+	if (m_header.size() > m_maxPayloadSize)
+	{
+		m_status = DecodeStatus::Oversized;
+		return;
+	}
+
+	m_remaining = m_header.size();
+	m_discarding = !m_limits.allows(m_header);
+	if (m_discarding)
+	{
+		++m_discardedPackets;
+		if (m_discardHandler)
+			m_discardHandler(m_header);
+	}
+	else if (m_headerHandler)
+	{
+		m_headerHandler(m_header);
+	}
+	/* There will be no chunks to end an empty payload: */
+	if (!m_remaining)
+		endPacket();
+}
+
+template<typename S, typename T>
+void StreamingPacketDecoder<S, T>::endPacket()
+{
+	m_headerRead = 0;
+	if (!m_discarding && m_endHandler)
+		m_endHandler(m_header);
+}
@@ -0,0 +1,227 @@
+#pragma once
+#include "PacketBatch.h"
+#include <QIODevice>
+#include <QMetaObject>
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/** \brief Reads and decodes packets in a worker thread, delivering them in
+ * batches
+ *
+ * The device is created and read in a QThread of its own. Decoded packets are
+ * collected in a PacketBatch, which is handed to the thread of a context
+ * object as a single queued call once it holds the maximum number of packets,
+ * or once its first packet has waited for the maximum latency. At high packet
+ * rates the receiving event loop thus handles one event per batch instead of
+ * one per packet.
+ *
+ * Batches are recycled once the handler returns, so a steady stream of
+ * packets does not allocate. Needs Qt 5.10 or later.
+ */
+template<typename S = std::uint32_t, typename T = std::uint32_t>
+class ThreadedPacketReceiver
+{
+public:
+	using Packet = GenericPacket<S, T>;
+	using Header = typename Packet::Header;
+	using DecodeStatus = typename Packet::DecodeStatus;
+	using Batch = PacketBatch<S, T>;
+	/** \brief Called in the context object's thread. The batch is only valid during the call */
+	using BatchHandler = std::function<void(const Batch &batch)>;
+	/** \brief Called in the context object's thread when reading stops because of a bad header */
+	using ErrorHandler = std::function<void(DecodeStatus status)>;
+	/** \brief Called in the worker thread to create the device to read from */
+	using DeviceFactory = std::function<QIODevice *()>;
+
+	/** \brief Deliver batches to \p handler in the thread of \p context
+	 *
+	 * Batches not yet delivered when \p context is destroyed are dropped.
+	 */
+	ThreadedPacketReceiver(QObject *context, BatchHandler handler);
+	~ThreadedPacketReceiver() { stop(); }
+	ThreadedPacketReceiver(const ThreadedPacketReceiver &) = delete;
+	ThreadedPacketReceiver &operator=(const ThreadedPacketReceiver &) = delete;
+
+	/* Only to be changed while stopped: */
+	void setErrorHandler(ErrorHandler handler) { m_shared->errorHandler = std::move(handler); }
+	void setMaxBatchSize(std::size_t packets) { m_maxBatchSize = packets; }
+	void setMaxLatency(int milliseconds) { m_maxLatency = milliseconds; }
+	void setMaxPayloadSize(std::size_t size) { m_maxPayloadSize = size; }
+
+	/** \brief Start the worker thread, and create the device with \p createDevice in it
+	 *
+	 * The device is deleted in the worker thread by stop().
+	 */
+	void start(DeviceFactory createDevice);
+	/** \brief Deliver what is decoded, delete the device and stop the worker thread */
+	void stop();
+	bool isRunning() const { return m_thread.isRunning(); }
+
+private:
+	/* State shared with queued calls, which may outlive the receiver: */
+	struct Shared
+	{
+		BatchHandler handler;
+		ErrorHandler errorHandler;
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Batch>> freeBatches;
+	};
+
+	/* These run in the worker thread: */
+	void open(const DeviceFactory &createDevice);
+	void readAvailable();
+	void flush();
+	void close();
+
+	QObject *m_context;
+	std::shared_ptr<Shared> m_shared = std::make_shared<Shared>();
+	std::size_t m_maxBatchSize = 1024;
+	int m_maxLatency = 5;
+	std::size_t m_maxPayloadSize = Header::maxSize();
+
+	QThread m_thread;
+	/* Lives in m_thread, to run calls there: */
+	QObject m_worker;
+	QIODevice *m_device = nullptr;
+	QTimer *m_timer = nullptr;
+	QByteArray m_buffer;
+	std::unique_ptr<Batch> m_batch;
+	bool m_failed = false;
+};
+
+
+template<typename S, typename T>
+ThreadedPacketReceiver<S, T>::ThreadedPacketReceiver(QObject *context, BatchHandler handler)
+	: m_context(context)
+{
+	m_shared->handler = std::move(handler);
+	m_worker.moveToThread(&m_thread);
+	/* finished() is emitted by the worker thread itself: */
+	QObject::connect(&m_thread, &QThread::finished, &m_worker, [this]() { close(); }, Qt::DirectConnection);
+}
+
+template<typename S, typename T>
+void ThreadedPacketReceiver<S, T>::start(DeviceFactory createDevice)
+{
+	if (m_thread.isRunning())
+		return;
+
+	m_thread.start();
+	QMetaObject::invokeMethod(&m_worker, [this, createDevice]() { open(createDevice); }, Qt::QueuedConnection);
+}
+
+template<typename S, typename T>
+void ThreadedPacketReceiver<S, T>::stop()
+{
+	m_thread.quit();
+	m_thread.wait();
+}
+
+template<typename S, typename T>
+void ThreadedPacketReceiver<S, T>::open(const DeviceFactory &createDevice)
+{
+	m_failed = false;
+	m_batch.reset(new Batch);
+	m_timer = new QTimer;
+	m_timer->setSingleShot(true);
+	m_timer->setInterval(m_maxLatency);
+	QObject::connect(m_timer, &QTimer::timeout, &m_worker, [this]() { flush(); });
+
+	m_device = createDevice();
+	QObject::connect(m_device, &QIODevice::readyRead, &m_worker, [this]() { readAvailable(); });
+	readAvailable();
+}
+
+template<typename S, typename T>
+void ThreadedPacketReceiver<S, T>::readAvailable()
+{
+	const qint64 available = m_device->bytesAvailable();
+	if (m_failed || available <= 0)
+		return;
+
+	const auto used = m_buffer.size();
+	m_buffer.resize(used + static_cast<GenericPacketHelper::ByteArraySize>(available));
+	const qint64 read = m_device->read(m_buffer.data() + used, available);
+	m_buffer.resize(used + (read > 0 ? static_cast<GenericPacketHelper::ByteArraySize>(read) : 0));
+
+	/* Decode everything in place, and remove the consumed bytes in one go: */
+	const std::size_t size = static_cast<std::size_t>(m_buffer.size());
+	std::size_t offset = 0;
+	auto packet = Packet::tryDecodeView(m_buffer.constData(), size, m_maxPayloadSize);
+	while (packet)
+	{
+		m_batch->append(*packet);
+		offset += Header::dataSize() + packet->payloadSize();
+		if (m_batch->size() >= m_maxBatchSize)
+			flush();
+		else if (m_batch->size() == 1)
+			m_timer->start();
+		packet = Packet::tryDecodeView(m_buffer.constData() + offset, size - offset, m_maxPayloadSize);
+	}
+	m_buffer.remove(0, static_cast<GenericPacketHelper::ByteArraySize>(offset));
+
+	if (packet.status() != DecodeStatus::Incomplete)
+	{
+		m_failed = true;
+		flush();
+		const auto shared = m_shared;
+		const DecodeStatus status = packet.status();
+		QMetaObject::invokeMethod(m_context, [shared, status]() {
+			if (shared->errorHandler)
+				shared->errorHandler(status);
+		}, Qt::QueuedConnection);
+	}
+}
+
+template<typename S, typename T>
+void ThreadedPacketReceiver<S, T>::flush()
+{
+	m_timer->stop();
+	if (m_batch->isEmpty())
+		return;
+
+	/* The batch returns to the pool when the queued call is done with it,
+	 * or is dropped: */
+	const auto shared = m_shared;
+	const std::shared_ptr<Batch> batch(m_batch.release(), [shared](Batch *done) {
+		std::unique_ptr<Batch> recycled(done);
+		recycled->clear();
+		const std::lock_guard<std::mutex> lock(shared->mutex);
+		shared->freeBatches.push_back(std::move(recycled));
+	});
+	QMetaObject::invokeMethod(m_context, [shared, batch]() {
+		if (shared->handler)
+			shared->handler(*batch);
+	}, Qt::QueuedConnection);
+
+	const std::lock_guard<std::mutex> lock(m_shared->mutex);
+	if (m_shared->freeBatches.empty())
+	{
+		m_batch.reset(new Batch);
+	}
+	else
+	{
+		m_batch = std::move(m_shared->freeBatches.back());
+		m_shared->freeBatches.pop_back();
+	}
+}
+
+template<typename S, typename T>
+void ThreadedPacketReceiver<S, T>::close()
+{
+	if (!m_device)
+		return;
+
+	flush();
+	delete m_timer;
+	delete m_device;
+	m_timer = nullptr;
+	m_device = nullptr;
+	m_buffer.clear();
+	m_batch.reset();
+}